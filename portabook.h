@@ -0,0 +1,200 @@
+/*
+ * portabook.h - Portabook extra module, shared declarations
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#ifndef __PORTABOOK_H__
+#define __PORTABOOK_H__
+
+#include <linux/types.h>
+#include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/workqueue.h>
+
+struct device;
+struct dentry;
+struct i2c_client;
+
+/*
+ * Internal helpers that portabook_test.c calls are only global in
+ * builds with CONFIG_PORTABOOK_EXT_KUNIT_TEST.
+ */
+#ifdef CONFIG_PORTABOOK_EXT_KUNIT_TEST
+#define PORTABOOK_TESTABLE
+#else
+#define PORTABOOK_TESTABLE static
+#endif
+
+/*
+ * Register access backends.  The battery code talks to the EC through
+ * portabook_ec_ops and the backlight code to the PMIC through
+ * portabook_pmic_ops, so the same logic can run on real I2C or on
+ * the emulator.
+ */
+struct portabook_ec_ops {
+    /* read LEN consecutive registers from REG, returns the number of
+       bus transactions used or a negative errno */
+    int (*read)(void *ctx, int reg, u8 *buf, int len);
+    /* optional: keep the bus powered until end() so the transactions
+       in between share one wakeup; end() is only called after begin()
+       returned 0 */
+    int (*begin)(void *ctx);
+    void (*end)(void *ctx);
+};
+
+struct portabook_reg_write {
+    u8 reg;
+    u8 val;
+};
+
+#define PORTABOOK_PMIC_MAX_SEQ	8
+
+struct portabook_pmic_ops {
+    /* 0 or a negative errno */
+    int (*readb)(void *ctx, int reg, u8 *val);
+    /* write NUM (<= PORTABOOK_PMIC_MAX_SEQ) registers in order,
+       without letting another bus master in between */
+    int (*write_seq)(void *ctx, const struct portabook_reg_write *seq,
+		     int num);
+    /* optional, as in portabook_ec_ops */
+    int (*begin)(void *ctx);
+    void (*end)(void *ctx);
+};
+
+/*
+ * Wait for an I2C adapter or client with ACPI HID and UID, see
+ * portabook_i2c.c.  FOUND and LOST run in process context; the
+ * watch holds a reference to the device in between.
+ */
+struct portabook_i2c_watch {
+    const char *hid;
+    const char *uid;		/* ACPI _UID too, unless NULL */
+    bool adapter;		/* match adapters instead of clients */
+    int (*found)(struct device *dev);
+    void (*lost)(struct device *dev);
+
+    /* private */
+    struct notifier_block nb;
+    struct work_struct work;
+    struct mutex lock;
+    struct device *dev;
+    bool bound;			/* FOUND succeeded for dev */
+};
+
+extern int portabook_i2c_watch_start(struct portabook_i2c_watch *w);
+extern void portabook_i2c_watch_stop(struct portabook_i2c_watch *w);
+extern int portabook_i2c_window_open(struct i2c_client *client);
+extern void portabook_i2c_window_close(struct i2c_client *client);
+
+/* debugfs statistics, see portabook_stats.c */
+enum portabook_supply {
+    PORTABOOK_SUPPLY_BATTERY,
+    PORTABOOK_SUPPLY_AC,
+    PORTABOOK_SUPPLY_NUM,
+};
+
+enum portabook_stat_counter {
+    PORTABOOK_STAT_EC_RETRY,		/* EC transaction retried */
+    PORTABOOK_STAT_REFRESH_FAILED,	/* refresh gave up */
+    PORTABOOK_STAT_BACKOFF_SKIPPED,	/* refresh skipped, backing off */
+    PORTABOOK_STAT_STALE_SERVED,	/* old values served after failure */
+    PORTABOOK_STAT_REVALIDATE,		/* expired values served, refresh queued */
+    PORTABOOK_STAT_EVENT,		/* re-read after a power source event */
+    PORTABOOK_STAT_BUS_WINDOW,		/* bus held awake for a batch */
+    PORTABOOK_STAT_BUS_WAKEUP,		/* ... that had to resume the controller */
+    PORTABOOK_STAT_BATCH_EARLY,		/* refresh also took fields due soon */
+    PORTABOOK_STAT_NUM,
+};
+
+extern void portabook_stats_inc(enum portabook_stat_counter counter);
+extern void portabook_stats_prop(enum portabook_supply supply, int psp);
+extern void portabook_stats_cache(bool hit);
+extern void portabook_stats_lock_wait(u64 ns);
+extern void portabook_stats_ec(int reg, int ret, u64 ns);
+extern void portabook_stats_pmic(int reg, int ret, u64 ns);
+extern struct dentry *portabook_debugfs_dir(void);
+extern int portabook_stats_init(void);
+extern void portabook_stats_cleanup(void);
+
+#ifdef CONFIG_PORTABOOK_EXT_BACKLIGHT
+extern int portabook_backlight_init(void);
+extern void portabook_backlight_cleanup(void);
+
+enum portabook_backlight_action {
+    BACKLIGHT_ACTION_DISABLE,	/* run the power-down sequence */
+    BACKLIGHT_ACTION_ENABLE,	/* run the power-up sequence at the level */
+    BACKLIGHT_ACTION_DEFER,	/* leave the level to the coalescing flush */
+    BACKLIGHT_ACTION_SET,	/* write the level now */
+};
+#ifdef CONFIG_PORTABOOK_EXT_KUNIT_TEST
+extern enum portabook_backlight_action
+portabook_backlight_action(int power, unsigned int state, int disabled,
+			   int flush_pending);
+#endif
+#endif
+
+/* power source notifications, see portabook_battery_event() */
+enum portabook_event {
+    PORTABOOK_EVENT_AC,		/* adapter plugged or unplugged */
+    PORTABOOK_EVENT_BATTERY,	/* battery state changed, e.g. critical */
+};
+
+#ifdef CONFIG_PORTABOOK_EXT_BATTERY
+extern int portabook_battery_init(void);
+extern void portabook_battery_cleanup(void);
+extern void portabook_battery_event(enum portabook_event event);
+
+/* energy profiling, see portabook_profile.c */
+struct portabook_battery;
+extern int portabook_battery_sample(struct portabook_battery *di,
+				    int *state, int *current_ma,
+				    int *voltage_mv);
+extern void portabook_profile_init(struct portabook_battery *di);
+extern void portabook_profile_cleanup(void);
+#else
+static inline void portabook_battery_event(enum portabook_event event) { }
+#endif
+
+/* emulated EC and PMIC, see portabook_emu.c */
+extern const struct portabook_ec_ops portabook_emu_ec_ops;
+extern const struct portabook_pmic_ops portabook_emu_pmic_ops;
+extern struct device *portabook_emu_device(void);
+#ifdef CONFIG_PORTABOOK_EXT_KUNIT_TEST
+extern int *portabook_emu_ec_value(int reg);
+#endif
+
+/* KUnit suites, see portabook_test.c; from 6.0 KUnit runs them itself */
+#if defined(CONFIG_PORTABOOK_EXT_KUNIT_TEST) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
+extern void portabook_test_run(void);
+extern void portabook_test_cleanup(void);
+#else
+static inline void portabook_test_run(void) { }
+static inline void portabook_test_cleanup(void) { }
+#endif
+#ifdef CONFIG_PORTABOOK_EXT_EMULATOR
+extern int portabook_emu_init(void);
+extern void portabook_emu_cleanup(void);
+extern bool portabook_emu_enabled(void);
+#else
+static inline int portabook_emu_init(void) { return 0; }
+static inline void portabook_emu_cleanup(void) { }
+static inline bool portabook_emu_enabled(void) { return false; }
+#endif
+
+#endif /* __PORTABOOK_H__ */
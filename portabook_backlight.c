@@ -21,6 +21,15 @@
 #include <linux/i2c.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "portabook.h"
+#include "portabook_compat.h"
+#include "portabook_trace.h"
 
 #ifndef FB_BLANK_UNBLANK
 #define FB_BLANK_UNBLANK 3
@@ -28,57 +37,633 @@
 #ifndef FB_BLANK_POWERDOWN
 #define FB_BLANK_POWERDOWN 0
 #endif
+#ifndef BL_CORE_FBBLANK
+#define BL_CORE_FBBLANK 0
+#endif
+
+static unsigned int backlight_coalesce_ms = 0;
+module_param(backlight_coalesce_ms, uint, 0644);
+MODULE_PARM_DESC(backlight_coalesce_ms,
+		 "write only the latest brightness within this window "
+		 "in milliseconds (0 = write every update)");
+
+static unsigned int backlight_fade_rate_hz = 60;
+module_param(backlight_fade_rate_hz, uint, 0644);
+MODULE_PARM_DESC(backlight_fade_rate_hz,
+		 "maximum brightness steps per second during a fade");
 
-static int intel_soc_pmic_rw_init(void);
-static void intel_soc_pmic_writeb(int reg, u8 val);
-static u8 intel_soc_pmic_readb(int reg);
+static bool pmic_cache = 1;
 
+static bool pmic_resume_verify = 0;
+module_param(pmic_resume_verify, bool, 0644);
+MODULE_PARM_DESC(pmic_resume_verify,
+		 "read the PMIC back on resume instead of trusting the "
+		 "shadow cache (for firmware that resets it)");
+
+/* PMIC register access, real I2C or emulator */
+static const struct portabook_pmic_ops *pmic_ops;
+static void *pmic_ctx;
+
+/*
+ * Write-through shadow of the PMIC registers this driver owns.  Only
+ * we program them, so they are cacheable; anything not listed here
+ * is treated as volatile and always goes to the bus.
+ */
+static struct portabook_pmic_reg {
+    int reg;
+    bool is_volatile;
+    bool valid;
+    u8 val;
+} pmic_regs[] = {
+    { 0x4B },
+    { 0x4E },
+    { 0x51 },
+};
+static DEFINE_MUTEX(pmic_lock);
+
+/* forget the whole shadow, under pmic_lock */
 static void
-portabook_disable_backlight(void)
+portabook_pmic_cache_drop(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(pmic_regs); i++)
+	pmic_regs[i].valid = 0;
+}
+
+/*
+ * Writes while the cache is off bypass the shadow, so it is dropped
+ * on every change instead of being trusted when it comes back on.
+ */
+static int
+pmic_cache_set(const char *val, const struct kernel_param *kp)
+{
+    int s;
+
+    mutex_lock(&pmic_lock);
+    s = param_set_bool(val, kp);
+    if (s == 0)
+	portabook_pmic_cache_drop();
+    mutex_unlock(&pmic_lock);
+    return s;
+}
+
+static const struct kernel_param_ops pmic_cache_ops = {
+    .set = pmic_cache_set,
+    .get = param_get_bool,
+};
+module_param_cb(pmic_cache, &pmic_cache_ops, &pmic_cache, 0644);
+MODULE_PARM_DESC(pmic_cache,
+		 "serve backlight PMIC register reads from a shadow cache");
+
+static struct portabook_pmic_reg *
+portabook_pmic_cached(int reg)
+{
+    int i;
+
+    if (!pmic_cache)
+	return NULL;
+    for (i = 0; i < ARRAY_SIZE(pmic_regs); i++)
+	if (pmic_regs[i].reg == reg)
+	    return pmic_regs[i].is_volatile ? NULL : &pmic_regs[i];
+    return NULL;
+}
+
+static void
+portabook_pmic_log_write(const struct portabook_reg_write *seq, int num,
+			   int ret, ktime_t start)
 {
-    intel_soc_pmic_writeb(0x51, 0x00);
-    intel_soc_pmic_writeb(0x4B, 0x7F);
+    u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    int i;
+
+    for (i = 0; i < num; i++) {
+	trace_portabook_pmic_write(seq[i].reg, seq[i].val, ret, ns);
+	portabook_stats_pmic(seq[i].reg, ret, ns);
+    }
+}
+
+/* hold the PMIC bus awake across several transfers, see pmic_ops */
+static int
+portabook_pmic_begin(void)
+{
+    return pmic_ops->begin ? pmic_ops->begin(pmic_ctx) : -EOPNOTSUPP;
 }
 
 static void
-portabook_enable_backlight(void)
+portabook_pmic_end(int held)
+{
+    if (held == 0)
+	pmic_ops->end(pmic_ctx);
+}
+
+static int
+portabook_pmic_readb(int reg, u8 *val)
 {
-    intel_soc_pmic_writeb(0x4B, 0xFF);
-    intel_soc_pmic_writeb(0x4E, 0xFF);
-    intel_soc_pmic_writeb(0x51, 0x01);
+    struct portabook_pmic_reg *r;
+    ktime_t start;
+    u64 ns;
+    int s = 0;
+
+    mutex_lock(&pmic_lock);
+    r = portabook_pmic_cached(reg);
+    if (r && r->valid) {
+	*val = r->val;
+	goto out;
+    }
+    if (!pmic_ops) {
+	s = -ENODEV;
+	goto out;
+    }
+    start = ktime_get();
+    s = pmic_ops->readb(pmic_ctx, reg, val);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    trace_portabook_pmic_read(reg, s < 0 ? 0 : *val, s, ns);
+    portabook_stats_pmic(reg, s, ns);
+    if (s == 0 && r) {
+	r->val = *val;
+	r->valid = 1;
+    }
+ out:
+    mutex_unlock(&pmic_lock);
+    return s;
 }
 
-static u32
+/*
+ * Write SEQ in order in one bus transaction, leaving out entries the
+ * shadow says the PMIC already holds.  On failure the written
+ * registers are dropped from the cache since their state is unknown.
+ */
+static int
+portabook_pmic_write_seq(const struct portabook_reg_write *seq, int num)
+{
+    struct portabook_reg_write out[PORTABOOK_PMIC_MAX_SEQ];
+    struct portabook_pmic_reg *r;
+    ktime_t start;
+    int i, n = 0;
+    int s = 0;
+
+    if (num > PORTABOOK_PMIC_MAX_SEQ)
+	return -EINVAL;
+
+    mutex_lock(&pmic_lock);
+    for (i = 0; i < num; i++) {
+	r = portabook_pmic_cached(seq[i].reg);
+	if (r && r->valid && r->val == seq[i].val)
+	    continue;
+	out[n++] = seq[i];
+	if (r) {
+	    r->val = seq[i].val;
+	    r->valid = 1;
+	}
+    }
+    if (n && !pmic_ops)
+	s = -ENODEV;
+    else if (n) {
+	start = ktime_get();
+	s = pmic_ops->write_seq(pmic_ctx, out, n);
+	portabook_pmic_log_write(out, n, s, start);
+    }
+    if (s < 0) {
+	for (i = 0; i < n; i++) {
+	    r = portabook_pmic_cached(out[i].reg);
+	    if (r)
+		r->valid = 0;
+	}
+    }
+    mutex_unlock(&pmic_lock);
+    return s;
+}
+
+static int
+portabook_pmic_writeb(int reg, u8 val)
+{
+    struct portabook_reg_write w = { reg, val };
+    return portabook_pmic_write_seq(&w, 1);
+}
+
+/*
+ * Check the shadow against the PMIC after resume and forget the
+ * registers that no longer match, so the next write sequence puts
+ * back exactly those and skips the rest.
+ */
+static void
+portabook_pmic_cache_verify(void)
+{
+    struct portabook_pmic_reg *r;
+    ktime_t start;
+    u64 ns;
+    u8 val;
+    int i, s;
+    int held;
+
+    mutex_lock(&pmic_lock);
+    if (!pmic_ops) {
+	mutex_unlock(&pmic_lock);
+	return;
+    }
+    held = portabook_pmic_begin();
+    for (i = 0; i < ARRAY_SIZE(pmic_regs); i++) {
+	r = &pmic_regs[i];
+	if (!r->valid || r->is_volatile)
+	    continue;
+	start = ktime_get();
+	s = pmic_ops->readb(pmic_ctx, r->reg, &val);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	trace_portabook_pmic_read(r->reg, s < 0 ? 0 : val, s, ns);
+	portabook_stats_pmic(r->reg, s, ns);
+	if (s < 0 || val != r->val)
+	    r->valid = 0;
+    }
+    portabook_pmic_end(held);
+    mutex_unlock(&pmic_lock);
+}
+
+/* last level written to 0x4E, -1 if unknown */
+static int backlight_level = -1;
+
+static int
+portabook_disable_backlight(void)
+{
+    static const struct portabook_reg_write seq[] = {
+	{ 0x4E, 0x00 },
+	{ 0x51, 0x00 },
+	{ 0x4B, 0x7F },
+    };
+    int s;
+
+    s = portabook_pmic_write_seq(seq, ARRAY_SIZE(seq));
+    backlight_level = s < 0 ? -1 : 0;
+    return s;
+}
+
+static int
+portabook_enable_backlight(u32 level)
+{
+    struct portabook_reg_write seq[] = {
+	{ 0x4B, 0xFF },
+	{ 0x4E, 0xFF },
+	{ 0x51, 0x01 },
+	{ 0x4E, level },
+    };
+    int s;
+
+    s = portabook_pmic_write_seq(seq, ARRAY_SIZE(seq));
+    backlight_level = s < 0 ? -1 : level;
+    return s;
+}
+
+static int
 portabook_get_backlight(void)
 {
-    return intel_soc_pmic_readb(0x4E);
+    u8 val;
+    int s;
+
+    s = portabook_pmic_readb(0x4E, &val);
+    return s < 0 ? s : val;
 }
  
-static void
+static int
 portabook_set_backlight(u32 level)
 {
-    intel_soc_pmic_writeb(0x4E, level);
+    int s;
+
+    s = portabook_pmic_writeb(0x4E, level);
+    backlight_level = s < 0 ? -1 : level;
+    return s;
+}
+
+/*
+ * Brightness write coalescing.  The first update after a quiet
+ * period is written at once and opens a window of
+ * backlight_coalesce_ms; updates inside the window only record the
+ * level, and the window's end writes the latest one.  backlight_lock
+ * serializes all PMIC programming.
+ */
+static DEFINE_MUTEX(backlight_lock);
+static int backlight_pending = -1;
+static void portabook_backlight_flush(struct work_struct *work);
+static DECLARE_DELAYED_WORK(backlight_flush_work, portabook_backlight_flush);
+
+static void
+portabook_backlight_flush(struct work_struct *work)
+{
+    mutex_lock(&backlight_lock);
+    if (backlight_pending >= 0) {
+	if (backlight_pending != backlight_level) {
+	    if (portabook_set_backlight(backlight_pending) < 0)
+		pr_warn_ratelimited("portabook_ext: "
+				    "failed to set backlight level\n");
+	    /* keep throttling while updates keep coming */
+	    schedule_delayed_work(&backlight_flush_work,
+				  msecs_to_jiffies(backlight_coalesce_ms));
+	}
+	backlight_pending = -1;
+    }
+    mutex_unlock(&backlight_lock);
+}
+
+/*
+ * In-kernel brightness fades.  Writing fade_target starts a fade from
+ * the current level over fade_duration_ms along fade_curve.  An
+ * hrtimer paces the steps at backlight_fade_rate_hz and kicks
+ * fade_work, which does the PMIC write in process context and re-arms
+ * the timer.  Fade state is protected by backlight_lock.
+ */
+enum portabook_fade_curve {
+    FADE_LINEAR,
+    FADE_EASE_IN,
+    FADE_EASE_OUT,
+    FADE_EASE_IN_OUT,
+};
+
+static const char * const portabook_fade_curve_names[] = {
+    [FADE_LINEAR]	= "linear",
+    [FADE_EASE_IN]	= "ease-in",
+    [FADE_EASE_OUT]	= "ease-out",
+    [FADE_EASE_IN_OUT]	= "ease-in-out",
+};
+
+static struct {
+    int active;
+    int from;
+    int to;
+    ktime_t start;
+    unsigned int duration_ms;
+    enum portabook_fade_curve curve;
+} fade;
+static unsigned int fade_duration_ms = 250;
+static enum portabook_fade_curve fade_curve = FADE_LINEAR;
+
+static void portabook_fade_step(struct work_struct *work);
+static DECLARE_WORK(fade_work, portabook_fade_step);
+static struct hrtimer fade_timer;
+
+#define FADE_ONE	1024
+
+/* map progress P in [0, FADE_ONE] through CURVE */
+static int
+portabook_fade_ease(enum portabook_fade_curve curve, int p)
+{
+    int q = FADE_ONE - p;
+
+    switch (curve) {
+    case FADE_EASE_IN:
+	return p * p / FADE_ONE;
+    case FADE_EASE_OUT:
+	return FADE_ONE - q * q / FADE_ONE;
+    case FADE_EASE_IN_OUT:
+	if (p < FADE_ONE / 2)
+	    return 2 * p * p / FADE_ONE;
+	return FADE_ONE - 2 * q * q / FADE_ONE;
+    default:
+	return p;
+    }
+}
+
+static enum hrtimer_restart
+portabook_fade_timer_fn(struct hrtimer *timer)
+{
+    schedule_work(&fade_work);
+    return HRTIMER_NORESTART;
 }
 
 /* interface for backlight */
 static int backlight_disabled;
+static int backlight_suspended;
 static struct backlight_device *portabook_backlight_device;
+
+static void
+portabook_fade_step(struct work_struct *work)
+{
+    struct backlight_device *bd = portabook_backlight_device;
+    s64 elapsed;
+    int level, done = 0;
+
+    /* same lock order as the backlight core calling update_status */
+    mutex_lock(&bd->update_lock);
+    mutex_lock(&backlight_lock);
+    if (!fade.active)
+	goto out;
+    if (backlight_disabled || bd->props.power != FB_BLANK_UNBLANK ||
+	(bd->props.state & (BL_CORE_SUSPENDED | BL_CORE_FBBLANK))) {
+	/* panel is off: land on the target for when it comes back */
+	bd->props.brightness = fade.to;
+	fade.active = 0;
+	goto out;
+    }
+
+    elapsed = ktime_ms_delta(ktime_get(), fade.start);
+    if (elapsed >= fade.duration_ms) {
+	level = fade.to;
+	done = 1;
+    }
+    else
+	level = fade.from + (fade.to - fade.from) *
+	    portabook_fade_ease(fade.curve,
+				div_u64(elapsed * FADE_ONE,
+					fade.duration_ms)) /
+	    FADE_ONE;
+
+    bd->props.brightness = level;
+    if (level != backlight_level && portabook_set_backlight(level) < 0)
+	pr_warn_ratelimited("portabook_ext: failed to set backlight level\n");
+    if (done)
+	fade.active = 0;
+    else
+	hrtimer_start(&fade_timer,
+		      ns_to_ktime(NSEC_PER_SEC /
+				  max(backlight_fade_rate_hz, 1U)),
+		      HRTIMER_MODE_REL);
+ out:
+    mutex_unlock(&backlight_lock);
+    mutex_unlock(&bd->update_lock);
+}
+
+/* start a fade to TARGET, replacing any fade in progress */
+static void
+portabook_fade_start(struct backlight_device *bd, int target)
+{
+    mutex_lock(&bd->update_lock);
+    mutex_lock(&backlight_lock);
+    fade.from = bd->props.brightness;
+    fade.to = target;
+    fade.start = ktime_get();
+    fade.duration_ms = fade_duration_ms;
+    fade.curve = fade_curve;
+    fade.active = 1;
+    /* a coalesced level must not land after the fade */
+    backlight_pending = -1;
+    mutex_unlock(&backlight_lock);
+    mutex_unlock(&bd->update_lock);
+    hrtimer_start(&fade_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+}
+
+static ssize_t
+fade_target_show(struct device *dev, struct device_attribute *attr,
+		 char *buf)
+{
+    struct backlight_device *bd = to_backlight_device(dev);
+    return sprintf(buf, "%d\n", fade.active ? fade.to : bd->props.brightness);
+}
+
+static ssize_t
+fade_target_store(struct device *dev, struct device_attribute *attr,
+		  const char *buf, size_t count)
+{
+    struct backlight_device *bd = to_backlight_device(dev);
+    unsigned int target;
+    int s;
+
+    s = kstrtouint(buf, 0, &target);
+    if (s)
+	return s;
+    if (target > bd->props.max_brightness)
+	return -EINVAL;
+    portabook_fade_start(bd, target);
+    return count;
+}
+static DEVICE_ATTR_RW(fade_target);
+
+static ssize_t
+fade_duration_ms_show(struct device *dev, struct device_attribute *attr,
+		      char *buf)
+{
+    return sprintf(buf, "%u\n", fade_duration_ms);
+}
+
+static ssize_t
+fade_duration_ms_store(struct device *dev, struct device_attribute *attr,
+		       const char *buf, size_t count)
+{
+    unsigned int ms;
+    int s;
+
+    s = kstrtouint(buf, 0, &ms);
+    if (s)
+	return s;
+    fade_duration_ms = ms;
+    return count;
+}
+static DEVICE_ATTR_RW(fade_duration_ms);
+
+static ssize_t
+fade_curve_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(portabook_fade_curve_names); i++)
+	len += sprintf(buf + len, i == fade_curve ? "[%s] " : "%s ",
+		       portabook_fade_curve_names[i]);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t
+fade_curve_store(struct device *dev, struct device_attribute *attr,
+		 const char *buf, size_t count)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(portabook_fade_curve_names); i++) {
+	if (sysfs_streq(buf, portabook_fade_curve_names[i])) {
+	    fade_curve = i;
+	    return count;
+	}
+    }
+    return -EINVAL;
+}
+static DEVICE_ATTR_RW(fade_curve);
+
+static struct attribute *portabook_fade_attrs[] = {
+    &dev_attr_fade_target.attr,
+    &dev_attr_fade_duration_ms.attr,
+    &dev_attr_fade_curve.attr,
+    NULL,
+};
+
+static const struct attribute_group portabook_fade_group = {
+    .attrs = portabook_fade_attrs,
+};
+
+/*
+ * What update_status has to do for the requested POWER and STATE,
+ * given whether the panel is currently powered down and whether a
+ * coalesced write is still pending.  No side effects.
+ */
+PORTABOOK_TESTABLE enum portabook_backlight_action
+portabook_backlight_action(int power, unsigned int state, int disabled,
+			   int flush_pending)
+{
+    if (power == FB_BLANK_POWERDOWN ||
+	(state & (BL_CORE_SUSPENDED | BL_CORE_FBBLANK)))
+	return BACKLIGHT_ACTION_DISABLE;
+    if (disabled)
+	return BACKLIGHT_ACTION_ENABLE;
+    if (flush_pending)
+	return BACKLIGHT_ACTION_DEFER;
+    return BACKLIGHT_ACTION_SET;
+}
+
 static int
 portabook_backlight_update_status(struct backlight_device *dev)
 {
-    if (dev->props.power == FB_BLANK_POWERDOWN ||
-	(dev->props.state & (BL_CORE_SUSPENDED | BL_CORE_FBBLANK))) {
-	portabook_set_backlight(0);
-	portabook_disable_backlight();
-	backlight_disabled = 1;
+    int level = dev->props.brightness;
+    int s = 0;
+
+    mutex_lock(&backlight_lock);
+    if (backlight_suspended && !(dev->props.state & BL_CORE_SUSPENDED) &&
+	pmic_resume_verify) {
+	/* the PMIC may have been reset while we slept; the enable
+	   sequence below then rewrites only what changed */
+	portabook_pmic_cache_verify();
     }
-    else {
-	if (backlight_disabled)
-	    portabook_enable_backlight();
-	portabook_set_backlight(dev->props.brightness);
-	backlight_disabled = 0;
+    backlight_suspended = !!(dev->props.state & BL_CORE_SUSPENDED);
+
+    switch (portabook_backlight_action(dev->props.power, dev->props.state,
+				       backlight_disabled,
+				       backlight_coalesce_ms &&
+				       delayed_work_pending(&backlight_flush_work))) {
+    case BACKLIGHT_ACTION_DISABLE:
+	/* a fade in progress ends at its target once the panel is back */
+	if (fade.active)
+	    dev->props.brightness = fade.to;
+	fade.active = 0;
+	/* power transitions are never deferred */
+	backlight_pending = -1;
+	if (dev->props.state & BL_CORE_SUSPENDED)
+	    cancel_delayed_work(&backlight_flush_work);
+	s = portabook_disable_backlight();
+	backlight_disabled = 1;
+	break;
+    case BACKLIGHT_ACTION_ENABLE:
+	fade.active = 0;
+	backlight_pending = -1;
+	s = portabook_enable_backlight(level);
+	if (s == 0)
+	    backlight_disabled = 0;
+	break;
+    case BACKLIGHT_ACTION_DEFER:
+	/* an explicit brightness write overrides a fade */
+	fade.active = 0;
+	backlight_pending = level;
+	break;
+    case BACKLIGHT_ACTION_SET:
+	fade.active = 0;
+	backlight_pending = -1;
+	if (level != backlight_level) {
+	    s = portabook_set_backlight(level);
+	    if (backlight_coalesce_ms)
+		schedule_delayed_work(&backlight_flush_work,
+				      msecs_to_jiffies(backlight_coalesce_ms));
+	}
+	break;
     }
-    return 1;
+    trace_portabook_backlight_state(dev->props.power, dev->props.state,
+				    level, backlight_disabled);
+    mutex_unlock(&backlight_lock);
+    return s;
 }
 
 static int
@@ -88,6 +673,7 @@ portabook_backlight_get_brightness(struct backlight_device *dev)
 }
 
 static struct backlight_ops portabook_backlight_ops = {
+    .options = BL_CORE_SUSPENDRESUME,
     .update_status = portabook_backlight_update_status,
     .get_brightness = portabook_backlight_get_brightness,
 };
@@ -96,15 +682,21 @@ static int
 portabook_backlight_device_register(struct device *parent)
 {
     struct backlight_properties props;
+    int s;
+
     memset(&props, 0, sizeof(props));
     props.type = BACKLIGHT_RAW;
     props.max_brightness = 255;
-    props.brightness = portabook_get_backlight();
+    s = portabook_get_backlight();
+    if (s < 0)
+	return s;
+    props.brightness = s;
     props.power = FB_BLANK_UNBLANK;
     
-    portabook_enable_backlight();
+    s = portabook_enable_backlight(props.brightness);
+    if (s < 0)
+	return s;
     backlight_disabled = 0;
-    portabook_set_backlight(props.brightness);
 
     portabook_backlight_device =
 	backlight_device_register("portabook_bl",
@@ -113,79 +705,153 @@ portabook_backlight_device_register(struct device *parent)
 				  &props);
     if (IS_ERR(portabook_backlight_device)) {
 	printk("portabook BACKLIGHT register error");
+	portabook_backlight_device = NULL;
 	return -ENODEV;
     }
+
+    hrtimer_setup(&fade_timer, portabook_fade_timer_fn, CLOCK_MONOTONIC,
+		  HRTIMER_MODE_REL);
+    s = sysfs_create_group(&portabook_backlight_device->dev.kobj,
+			   &portabook_fade_group);
+    if (s)
+	printk("portabook BACKLIGHT fade attributes unavailable");
     return 0;
 }
 
 static void
 portabook_backlight_device_unregister(void)
 {
+    if (!portabook_backlight_device)
+	return;
+    sysfs_remove_group(&portabook_backlight_device->dev.kobj,
+		       &portabook_fade_group);
+    mutex_lock(&backlight_lock);
+    fade.active = 0;
+    mutex_unlock(&backlight_lock);
+    hrtimer_cancel(&fade_timer);
+    cancel_work_sync(&fade_work);
+    hrtimer_cancel(&fade_timer);
     backlight_device_unregister(portabook_backlight_device);
+    portabook_backlight_device = NULL;
 }
 
 static struct i2c_client *intel_soc_pmic_i2c;
 
+/* register number and data byte under one repeated-start transfer */
 static int
-intel_soc_pmic_rw_init(void)
+intel_soc_pmic_readb(void *ctx, int reg, u8 *val)
 {
-    struct device *dev;
-    dev = bus_find_device_by_name(&i2c_bus_type, NULL, "i2c-INT33FD:00");
-    if (!dev)
-	return -1;
-    intel_soc_pmic_i2c = i2c_verify_client(dev);
-    
-    if (!intel_soc_pmic_i2c)
-	return -1;
+    struct i2c_client *client = ctx;
+    u8 addr = reg;
+    struct i2c_msg msgs[2] = {
+	{ .addr = client->addr, .flags = 0,        .len = 1, .buf = &addr },
+	{ .addr = client->addr, .flags = I2C_M_RD, .len = 1, .buf = val },
+    };
+    int s;
+
+    s = i2c_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+    if (s < 0) return s;
+    if (s != ARRAY_SIZE(msgs)) return -EIO;
     return 0;
 }
 
-static u8
-intel_soc_pmic_readb(int reg)
+/* one write message per register, all in a single i2c_transfer */
+static int
+intel_soc_pmic_write_seq(void *ctx, const struct portabook_reg_write *seq,
+			 int num)
 {
-    int s;
-    char buf[1];
+    struct i2c_client *client = ctx;
+    struct i2c_msg msgs[PORTABOOK_PMIC_MAX_SEQ];
+    u8 buf[PORTABOOK_PMIC_MAX_SEQ][2];
+    int i, s;
 
-    if (!intel_soc_pmic_i2c) return -1;
-    
-    /* send reg no */
-    buf[0] = reg;
-    s = i2c_master_send(intel_soc_pmic_i2c, buf, 1);
-    if (s < 0) return 255;
-    /* recv data */
-    s = i2c_master_recv(intel_soc_pmic_i2c, buf, 1);
-    if (s < 0) return 255;
-    
-    return buf[0] & 0xff;
+    if (num > PORTABOOK_PMIC_MAX_SEQ)
+	return -EINVAL;
+    for (i = 0; i < num; i++) {
+	buf[i][0] = seq[i].reg;
+	buf[i][1] = seq[i].val;
+	msgs[i].addr  = client->addr;
+	msgs[i].flags = 0;
+	msgs[i].len   = 2;
+	msgs[i].buf   = buf[i];
+    }
+    s = i2c_transfer(client->adapter, msgs, num);
+    if (s < 0) return s;
+    if (s != num) return -EIO;
+    return 0;
+}
+
+static int
+intel_soc_pmic_begin(void *ctx)
+{
+    return portabook_i2c_window_open(ctx);
 }
 
 static void
-intel_soc_pmic_writeb(int reg, u8 val)
+intel_soc_pmic_end(void *ctx)
 {
-    char buf[2];
-    if (!intel_soc_pmic_i2c) return;
+    portabook_i2c_window_close(ctx);
+}
 
-    buf[0] = reg;
-    buf[1] = val;
-    i2c_master_send(intel_soc_pmic_i2c, buf, 2);
+static const struct portabook_pmic_ops intel_soc_pmic_ops = {
+    .readb     = intel_soc_pmic_readb,
+    .write_seq = intel_soc_pmic_write_seq,
+    .begin     = intel_soc_pmic_begin,
+    .end       = intel_soc_pmic_end,
+};
+
+static int
+intel_soc_pmic_found(struct device *dev)
+{
+    intel_soc_pmic_i2c = i2c_verify_client(dev);
+    mutex_lock(&pmic_lock);
+    pmic_ops = &intel_soc_pmic_ops;
+    pmic_ctx = intel_soc_pmic_i2c;
+    mutex_unlock(&pmic_lock);
+    return portabook_backlight_device_register(dev);
 }
 
+/* our backlight device is a child of the PMIC client */
+static void
+intel_soc_pmic_lost(struct device *dev)
+{
+    portabook_backlight_device_unregister();
+    /* a coalesced level has nowhere to go now */
+    cancel_delayed_work_sync(&backlight_flush_work);
+
+    mutex_lock(&pmic_lock);
+    pmic_ops = NULL;
+    pmic_ctx = NULL;
+    /* a PMIC that comes back starts from its reset values */
+    portabook_pmic_cache_drop();
+    mutex_unlock(&pmic_lock);
+    intel_soc_pmic_i2c = NULL;
+}
+
+static struct portabook_i2c_watch intel_soc_pmic_watch = {
+    .hid   = "INT33FD",
+    .found = intel_soc_pmic_found,
+    .lost  = intel_soc_pmic_lost,
+};
+
 int
 portabook_backlight_init(void)
 {
-    int error = 0;
-    error = intel_soc_pmic_rw_init();
-    if (error)
-	return -ENODEV;
-
-    error = portabook_backlight_device_register(&intel_soc_pmic_i2c->dev);
-    if (error)
-	return -EINVAL;
-    return 0;
+    if (portabook_emu_enabled()) {
+	pmic_ops = &portabook_emu_pmic_ops;
+	pmic_ctx = NULL;
+	return portabook_backlight_device_register(portabook_emu_device());
+    }
+    return portabook_i2c_watch_start(&intel_soc_pmic_watch);
 }
 
 void
 portabook_backlight_cleanup(void)
 {
+    if (!portabook_emu_enabled())
+	portabook_i2c_watch_stop(&intel_soc_pmic_watch);
     portabook_backlight_device_unregister();
+    /* write out a coalesced level before going away */
+    flush_delayed_work(&backlight_flush_work);
+    cancel_delayed_work_sync(&backlight_flush_work);
 }
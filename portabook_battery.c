@@ -66,84 +66,287 @@
 #include <linux/module.h>
 #include <linux/param.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
 #include <linux/delay.h>
 #include <linux/i2c.h>
 #include <linux/slab.h>
 #include <linux/platform_device.h>
 #include <linux/power_supply.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/acpi.h>
 
-#define I2C_DEVICE_NAME	"portabook_batt"
+#include "portabook.h"
+#include "portabook_uapi.h"
+#include "portabook_compat.h"
+#include "portabook_trace.h"
+#include "portabook_battery.h"
 
-#define I2C_ADAPTER_NAME "Synopsys DesignWare I2C adapter"
+#define I2C_DEVICE_NAME	"portabook_batt"
 
-#ifndef ACPI_BATTERY_STATE_DISCHARGING
-#define ACPI_BATTERY_STATE_DISCHARGING	(1 << 0)
-#endif
-#ifndef ACPI_BATTERY_STATE_CHARGING
-#define ACPI_BATTERY_STATE_CHARGING	(1 << 1)
-#endif
-#ifndef ACPI_BATTERY_STATE_CRITICAL
-#define ACPI_BATTERY_STATE_CRITICAL	(1 << 2)
-#endif
-#ifndef ACPI_BATTERY_VALUE_UNKNOWN
-#define ACPI_BATTERY_VALUE_UNKNOWN	0xFFFFFFFF
-#endif
+/* Bay Trail LPSS I2C controller (Synopsys DesignWare) */
+#define I2C_ADAPTER_HID	"80860F41"
 
-#define DESIGN_CAPACITY			4800	/* 4800 mAh */
-#define DESIGN_VOLTAGE			3800	/* 3.8V */
-#define DESIGN_WARN_CAPACITY		800	/* 800 mAh */
-
-#define BATT_INDEX_CMD			0x82
-#define BATT_DATA_CMD			0x80
-
-#define	BATT_INFO_LAST_CAP_H		0x144
-#define	BATT_INFO_LAST_CAP_L		0x145
-#define	BATT_INFO_STATUS_H		0x1A0
-#define	BATT_INFO_STATUS_L		0x1A1
-#define	BATT_INFO_PRESENT_RATE_H	0x1A2
-#define	BATT_INFO_PRESENT_RATE_L	0x1A3
-#define	BATT_INFO_REMAIN_CAP_H		0x1A4
-#define	BATT_INFO_REMAIN_CAP_L		0x1A5
-#define	BATT_INFO_PRESENT_VOLT_H	0x1A6
-#define	BATT_INFO_PRESENT_VOLT_L	0x1A7
-#define BATT_INFO_AC_ADAPTER		0x10B
+/*
+ * All seven LPSS controllers share the HID, and they probe
+ * asynchronously, so the first one to appear is not a stable choice.
+ * The EC is expected on I2C1, the first controller, which is what the
+ * old scan for the lowest numbered DesignWare adapter found.
+ */
+static char *battery_adapter_uid = "1";
+module_param(battery_adapter_uid, charp, 0444);
+MODULE_PARM_DESC(battery_adapter_uid,
+		 "ACPI _UID of the I2C controller the EC is on "
+		 "(empty = first controller found)");
 
 struct portabook_battery {
-    struct i2c_client *i2c_client;
-    struct mutex lock;
+    struct device *dev;
+    const struct portabook_ec_ops *ec_ops;
+    void *ec_ctx;
+    struct mutex lock;		/* serializes refreshes */
+    seqlock_t seqlock;		/* protects info */
     
     struct power_supply *bat;
     struct power_supply_desc bat_desc;
     struct power_supply *ac;
     struct power_supply_desc ac_desc;
     
-    /* portabook battery data,
-       valid after calling portabook_batt_battery_read_status() */
-    unsigned long update_time;	/* jiffies when data read */
+    struct delayed_work poll_work;
+    struct work_struct refresh_work;
+    struct work_struct revalidate_work;
+    atomic_t revalidate_mask;	/* fields readers want refreshed */
+    struct work_struct event_work;
+    atomic_t event_mask;	/* fields power source events invalidated */
+    bool dying;			/* teardown started, nothing more is queued;
+				   set under lock and seqlock */
+    bool suspended;		/* no bus I/O until resume, likewise */
     
-    int rate_now;
-    int capacity_now;
-    int voltage_now;
-    int full_charge_capacity;
-    int state;
-    int ac_adapter;
+    struct portabook_battery_info info;
+    
+    /* last values reported by power_supply_changed(), under lock */
+    struct portabook_battery_info notified;
+    int notified_valid;
+
+    /* EC failure state, under lock; last_error is also read locklessly */
+    int fail_count;		/* consecutive failed refreshes */
+    int last_error;		/* errno of the last refresh, 0 if it worked */
+    unsigned long retry_after;	/* no bus I/O before this while failing */
+    struct dentry *debugfs;
+
+    /* page mapped by /dev/portabook readers, written under lock */
+    struct portabook_shared *shared;
 };
 
-static unsigned int battery_info_cache_time = 1000;
+PORTABOOK_TESTABLE unsigned int battery_info_cache_time = 1000;
 module_param(battery_info_cache_time, uint, 0644);
 MODULE_PARM_DESC(battery_info_cache_time,
-		 "battery information caching time in milliseconds");
+		 "battery rate, remaining capacity and voltage caching time "
+		 "in milliseconds");
+
+/* no slower than the fast class: ACPI notifications that would
+   re-read AC and status at once are not verified on a Portabook */
+PORTABOOK_TESTABLE unsigned int ac_info_cache_time = 1000;
+module_param(ac_info_cache_time, uint, 0644);
+MODULE_PARM_DESC(ac_info_cache_time,
+		 "AC adapter and battery state caching time in milliseconds");
 
-static unsigned int battery_fullcharged_percentage = 95;
+PORTABOOK_TESTABLE unsigned int battery_full_cache_time = 600000;
+module_param(battery_full_cache_time, uint, 0644);
+MODULE_PARM_DESC(battery_full_cache_time,
+		 "last full charge capacity caching time in milliseconds; it "
+		 "is also re-read when charging starts or stops");
+
+static unsigned int * const battinfo_class_ttl[BATTINFO_NUM_CLASSES] = {
+    [BATTINFO_CLASS_STATIC]	= &battery_full_cache_time,
+    [BATTINFO_CLASS_STATE]	= &ac_info_cache_time,
+    [BATTINFO_CLASS_FAST]	= &battery_info_cache_time,
+};
+
+PORTABOOK_TESTABLE unsigned int battery_fullcharged_percentage = 95;
 module_param(battery_fullcharged_percentage, uint, 0644);
 MODULE_PARM_DESC(battery_fullcharged_percentage,
 		 "percentage of capacit to be considered as full charged");
 
-static unsigned int battery_ignore_discharge_rate = 200;
+PORTABOOK_TESTABLE unsigned int battery_ignore_discharge_rate = 200;
 module_param(battery_ignore_discharge_rate, uint, 0644);
 MODULE_PARM_DESC(battery_ignore_discharge_rate,
 		 "smaller discharge rate in mA than this value is ignored");
 
+static struct portabook_battery *__portabook_battery_di;
+/* keeps __portabook_battery_di alive for /dev/portabook and parameters */
+static DECLARE_RWSEM(portabook_cdev_sem);
+
+/* latest info.seq, for waking /dev/portabook readers */
+static atomic_long_t portabook_cdev_seq = ATOMIC_LONG_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(portabook_cdev_wait);
+
+static unsigned int battery_poll_interval = 0;
+
+static int
+battery_poll_interval_set(const char *val, const struct kernel_param *kp)
+{
+    struct portabook_battery *di;
+    int s;
+
+    s = param_set_uint(val, kp);
+    if (s)
+	return s;
+    /* same rule as portabook_battery_queue(), teardown cancels after */
+    down_read(&portabook_cdev_sem);
+    di = __portabook_battery_di;
+    if (di) {
+	read_seqlock_excl(&di->seqlock);
+	if (!di->dying && !di->suspended)
+	    mod_delayed_work(system_wq, &di->poll_work, 0);
+	read_sequnlock_excl(&di->seqlock);
+    }
+    up_read(&portabook_cdev_sem);
+    return 0;
+}
+
+static const struct kernel_param_ops battery_poll_interval_ops = {
+    .set = battery_poll_interval_set,
+    .get = param_get_uint,
+};
+module_param_cb(battery_poll_interval, &battery_poll_interval_ops,
+		&battery_poll_interval, 0644);
+MODULE_PARM_DESC(battery_poll_interval,
+		 "interval in milliseconds to refresh battery information "
+		 "in background (0 = read on demand)");
+
+static bool battery_poll_adaptive = 0;
+module_param(battery_poll_adaptive, bool, 0644);
+MODULE_PARM_DESC(battery_poll_adaptive,
+		 "adapt the background refresh interval to battery state");
+
+static unsigned int battery_poll_fast_interval = 2000;
+module_param(battery_poll_fast_interval, uint, 0644);
+MODULE_PARM_DESC(battery_poll_fast_interval,
+		 "adaptive refresh interval in milliseconds while charging, "
+		 "near low capacity or at high discharge rate");
+
+static unsigned int battery_poll_slow_interval = 30000;
+module_param(battery_poll_slow_interval, uint, 0644);
+MODULE_PARM_DESC(battery_poll_slow_interval,
+		 "adaptive refresh interval in milliseconds while idle on AC");
+
+static unsigned int battery_poll_fast_rate = 1000;
+module_param(battery_poll_fast_rate, uint, 0644);
+MODULE_PARM_DESC(battery_poll_fast_rate,
+		 "discharge rate in mA from which the fast interval is used");
+
+static bool battery_notify = 1;
+module_param(battery_notify, bool, 0644);
+MODULE_PARM_DESC(battery_notify,
+		 "send power_supply change events when values change");
+
+static unsigned int battery_notify_capacity_step = 1;
+module_param(battery_notify_capacity_step, uint, 0644);
+MODULE_PARM_DESC(battery_notify_capacity_step,
+		 "capacity change in percent that triggers an event");
+
+static unsigned int battery_notify_rate_hysteresis = 0;
+module_param(battery_notify_rate_hysteresis, uint, 0644);
+MODULE_PARM_DESC(battery_notify_rate_hysteresis,
+		 "rate change in mA that triggers an event (0 = never)");
+
+static unsigned int battery_notify_voltage_hysteresis = 0;
+module_param(battery_notify_voltage_hysteresis, uint, 0644);
+MODULE_PARM_DESC(battery_notify_voltage_hysteresis,
+		 "voltage change in mV that triggers an event (0 = never)");
+
+/* the combined modes have not been verified on a Portabook yet */
+static unsigned int battery_xfer_mode = 0;
+module_param(battery_xfer_mode, uint, 0644);
+MODULE_PARM_DESC(battery_xfer_mode,
+		 "EC register access: 0=SMBus (2 transfers per register), "
+		 "1=combined i2c_transfer per register, "
+		 "2=combined with index auto-increment for contiguous registers; "
+		 "1 and 2 fall back to SMBus for a register the EC rejects");
+
+static unsigned int battery_rate_avg_window_ms = 60000;
+module_param(battery_rate_avg_window_ms, uint, 0644);
+MODULE_PARM_DESC(battery_rate_avg_window_ms,
+		 "time constant in milliseconds of the averaged rate used for "
+		 "current_avg and time_to_*_avg (0 = no averaging)");
+
+static unsigned int battery_xfer_retries = 2;
+module_param(battery_xfer_retries, uint, 0644);
+MODULE_PARM_DESC(battery_xfer_retries,
+		 "retries of a failed EC transaction before giving up");
+
+static unsigned int battery_backoff_ms = 100;
+module_param(battery_backoff_ms, uint, 0644);
+MODULE_PARM_DESC(battery_backoff_ms,
+		 "wait in milliseconds after a failed refresh, doubled on "
+		 "each further failure");
+
+static unsigned int battery_backoff_max_ms = 30000;
+module_param(battery_backoff_max_ms, uint, 0644);
+MODULE_PARM_DESC(battery_backoff_max_ms,
+		 "upper limit of the refresh backoff in milliseconds");
+
+static unsigned int battery_revalidate_ms = 5000;
+module_param(battery_revalidate_ms, uint, 0644);
+MODULE_PARM_DESC(battery_revalidate_ms,
+		 "serve values up to this many milliseconds past their cache "
+		 "time while one background refresh runs; older ones are "
+		 "waited for (0 = always wait)");
+
+static unsigned int battery_batch_slack_ms = 250;
+module_param(battery_batch_slack_ms, uint, 0644);
+MODULE_PARM_DESC(battery_batch_slack_ms,
+		 "when the EC has to be read anyway, also read fields that "
+		 "expire within this many milliseconds (0 = only expired)");
+
+static unsigned int battery_stale_limit_ms = 60000;
+module_param(battery_stale_limit_ms, uint, 0644);
+MODULE_PARM_DESC(battery_stale_limit_ms,
+		 "while the EC fails, serve cached values up to this age in "
+		 "milliseconds, then return an error (0 = forever)");
+
+/*
+ * EC registers backing each field, sorted by register number so that
+ * adjacent entries can be merged into one run.  H/L pairs have len 2.
+ */
+#define BATTINFO_MAX_RUN	8
+
+static const struct portabook_battinfo {
+    int reg;
+    int len;
+    size_t offset;
+    enum portabook_battinfo_class class;
+} portabook_battinfo_table[BATTINFO_NUM_FIELDS] = {
+    [BATTINFO_AC_ADAPTER] = { BATT_INFO_AC_ADAPTER, 1,
+      offsetof(struct portabook_battery_info, ac_adapter),
+      BATTINFO_CLASS_STATE },
+    [BATTINFO_LAST_CAP] = { BATT_INFO_LAST_CAP_H, 2,
+      offsetof(struct portabook_battery_info, full_charge_capacity),
+      BATTINFO_CLASS_STATIC },
+    [BATTINFO_STATUS] = { BATT_INFO_STATUS_H, 2,
+      offsetof(struct portabook_battery_info, state),
+      BATTINFO_CLASS_STATE },
+    [BATTINFO_PRESENT_RATE] = { BATT_INFO_PRESENT_RATE_H, 2,
+      offsetof(struct portabook_battery_info, rate_now),
+      BATTINFO_CLASS_FAST },
+    [BATTINFO_REMAIN_CAP] = { BATT_INFO_REMAIN_CAP_H, 2,
+      offsetof(struct portabook_battery_info, capacity_now),
+      BATTINFO_CLASS_FAST },
+    [BATTINFO_PRESENT_VOLT] = { BATT_INFO_PRESENT_VOLT_H, 2,
+      offsetof(struct portabook_battery_info, voltage_now),
+      BATTINFO_CLASS_FAST },
+};
+
 static int
 read_battinfo_reg(struct i2c_client *i2c_client, int reg, u8 *value)
 {
@@ -160,67 +363,936 @@ read_battinfo_reg(struct i2c_client *i2c_client, int reg, u8 *value)
     return 0;
 }
 
+/*
+ * Read LEN registers starting at REG in a single i2c_transfer.
+ * Without AUTOINC only LEN == 1 is meaningful: the index is written
+ * and the data byte read back under one repeated-start sequence.
+ * With AUTOINC the EC is expected to advance its index after every
+ * data read, so one index write serves the whole run.
+ */
 static int
-portabook_battery_read_status(struct portabook_battery *di)
+read_battinfo_xfer(struct i2c_client *i2c_client, int reg, u8 *buf, int len)
 {
-    struct i2c_client *i2c_client = di->i2c_client;
-    u8 buf[2];
+    u8 index[3];
+    u8 cmd = BATT_DATA_CMD;
+    struct i2c_msg msgs[1 + 2 * BATTINFO_MAX_RUN];
+    int i, n, s;
+
+    if (len < 1 || len > BATTINFO_MAX_RUN)
+	return -EINVAL;
+
+    index[0] = BATT_INDEX_CMD;
+    index[1] = reg >> 8;
+    index[2] = reg & 0xff;
+    msgs[0].addr  = i2c_client->addr;
+    msgs[0].flags = 0;
+    msgs[0].len   = sizeof(index);
+    msgs[0].buf   = index;
+    n = 1;
+    for (i = 0; i < len; i++) {
+	msgs[n].addr  = i2c_client->addr;
+	msgs[n].flags = 0;
+	msgs[n].len   = 1;
+	msgs[n].buf   = &cmd;
+	n++;
+	msgs[n].addr  = i2c_client->addr;
+	msgs[n].flags = I2C_M_RD;
+	msgs[n].len   = 1;
+	msgs[n].buf   = &buf[i];
+	n++;
+    }
+    s = i2c_transfer(i2c_client->adapter, msgs, n);
+    if (s < 0) return s;
+    if (s != n) return -EIO;
+    return 0;
+}
+
+/*
+ * I2C backend: read a run of contiguous registers with the fewest
+ * transactions the selected mode allows, falling back to the
+ * per-register SMBus path when the adapter cannot do plain I2C or
+ * a combined read fails for any reason.
+ */
+static int
+portabook_ec_i2c_read(void *ctx, int reg, u8 *buf, int len)
+{
+    struct i2c_client *i2c_client = ctx;
+    int combined = battery_xfer_mode >= 1 &&
+	i2c_check_functionality(i2c_client->adapter, I2C_FUNC_I2C);
+    int xfers = 0;
+    int i, s;
+
+    if (combined && battery_xfer_mode >= 2 && len > 1) {
+	s = read_battinfo_xfer(i2c_client, reg, buf, len);
+	xfers++;
+	if (s == 0)
+	    return xfers;
+    }
+    for (i = 0; i < len; i++) {
+	if (combined) {
+	    s = read_battinfo_xfer(i2c_client, reg + i, &buf[i], 1);
+	    xfers++;
+	    /* an EC that NAKs the repeated start still talks SMBus */
+	    if (s == 0)
+		goto next;
+	}
+	s = read_battinfo_reg(i2c_client, reg + i, &buf[i]);
+	xfers += 2;
+    next:
+	if (s < 0) return s;
+    }
+    return xfers;
+}
+
+static int
+portabook_ec_i2c_begin(void *ctx)
+{
+    return portabook_i2c_window_open(ctx);
+}
+
+static void
+portabook_ec_i2c_end(void *ctx)
+{
+    portabook_i2c_window_close(ctx);
+}
+
+static const struct portabook_ec_ops portabook_ec_i2c_ops = {
+    .read  = portabook_ec_i2c_read,
+    .begin = portabook_ec_i2c_begin,
+    .end   = portabook_ec_i2c_end,
+};
+
+/*
+ * Store field I of INFO from BUF, which holds the register run that
+ * starts at RUN_REG.  Two-byte fields are big endian (H then L).
+ */
+PORTABOOK_TESTABLE void
+portabook_battinfo_decode(struct portabook_battery_info *info, int i,
+			  int run_reg, const u8 *buf, unsigned long now)
+{
+    const struct portabook_battinfo *entry = &portabook_battinfo_table[i];
+    const u8 *p = buf + (entry->reg - run_reg);
+    int *field = (int *)((char *)info + entry->offset);
+
+    if (entry->len == 2)
+	*field = (p[0] << 8) | p[1];
+    else
+	*field = p[0];
+    info->update_time[i] = now;
+    info->expired &= ~(1 << i);
+}
+
+/*
+ * Read the fields selected by MASK into INFO, leaving the others
+ * untouched.  Does bus I/O only; callers decide how the result is
+ * published.
+ */
+static int
+portabook_battery_fetch(struct portabook_battery *di,
+			struct portabook_battery_info *info,
+			unsigned int mask)
+{
+    const struct portabook_battinfo *entry;
+    u8 buf[BATTINFO_MAX_RUN];
+    ktime_t start, t;
+    unsigned long now;
+    u64 ns;
+    int i, j, reg, len, xfers, try;
+    int held;
+    int s;
+
+    start = ktime_get();
+    xfers = 0;
+    /* one bus wakeup for all the runs */
+    held = di->ec_ops->begin ? di->ec_ops->begin(di->ec_ctx) : -EOPNOTSUPP;
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i = j) {
+	if (!(mask & (1 << i))) {
+	    j = i + 1;
+	    continue;
+	}
+	/* merge following fields while they stay contiguous */
+	reg = portabook_battinfo_table[i].reg;
+	len = portabook_battinfo_table[i].len;
+	for (j = i + 1; j < BATTINFO_NUM_FIELDS; j++) {
+	    entry = &portabook_battinfo_table[j];
+	    if (!(mask & (1 << j)) ||
+		entry->reg != reg + len ||
+		len + entry->len > BATTINFO_MAX_RUN)
+		break;
+	    len += entry->len;
+	}
+
+	for (try = 0; ; try++) {
+	    t = ktime_get();
+	    s = di->ec_ops->read(di->ec_ctx, reg, buf, len);
+	    ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+	    trace_portabook_ec_read(reg, len, buf, s, ns);
+	    portabook_stats_ec(reg, s, ns);
+	    if (s >= 0 || try >= battery_xfer_retries)
+		break;
+	    portabook_stats_inc(PORTABOOK_STAT_EC_RETRY);
+	    usleep_range(1000, 2000);
+	}
+	if (s < 0) goto out;
+	xfers += s;
+
+	now = jiffies;
+	for (; i < j; i++)
+	    portabook_battinfo_decode(info, i, reg, buf, now);
+    }
+    dev_dbg(di->dev, "refresh %#x: %d transfers in %lld us\n",
+	    mask, xfers, ktime_us_delta(ktime_get(), start));
+    s = 0;
+ out:
+    if (held == 0)
+	di->ec_ops->end(di->ec_ctx);
+    trace_portabook_battery_refresh(mask, mask, s,
+				    ktime_to_ns(ktime_sub(ktime_get(), start)));
+    return s;
+}
+
+/*
+ * Readers copy the snapshot under di->seqlock without blocking; only
+ * refreshers take di->lock, which serializes the bus I/O.
+ */
+static void
+portabook_battery_snapshot(struct portabook_battery *di,
+			   struct portabook_battery_info *info)
+{
+    unsigned int seq;
+
+    do {
+	seq = read_seqbegin(&di->seqlock);
+	*info = di->info;
+    } while (read_seqretry(&di->seqlock, seq));
+}
+
+static void
+portabook_battery_publish(struct portabook_battery *di,
+			  const struct portabook_battery_info *info)
+{
+    write_seqlock(&di->seqlock);
+    di->info = *info;
+    write_sequnlock(&di->seqlock);
+}
+
+/*
+ * Queue one of di's work items unless teardown or suspend has started.
+ * The check and the queueing happen under the seqlock's spinlock, so
+ * once di->dying or di->suspended is set the cancel_work_sync() calls
+ * that follow see every work item that will be queued.
+ */
+static void
+portabook_battery_queue(struct portabook_battery *di, struct work_struct *work)
+{
+    read_seqlock_excl(&di->seqlock);
+    if (!di->dying && !di->suspended)
+	schedule_work(work);
+    read_sequnlock_excl(&di->seqlock);
+}
+
+static int
+portabook_battery_percent(const struct portabook_battery_info *info)
+{
+    if (info->capacity_now && info->full_charge_capacity)
+	return info->capacity_now * 100 / info->full_charge_capacity;
+    return 0;
+}
+
+#define BATTERY_STATE_MASK	(ACPI_BATTERY_STATE_DISCHARGING | \
+				 ACPI_BATTERY_STATE_CHARGING | \
+				 ACPI_BATTERY_STATE_CRITICAL)
+
+static void portabook_battery_share(struct portabook_battery *di);
+
+/*
+ * Fold a new rate sample into INFO->rate_avg.  Samples come at
+ * irregular intervals, so each one is weighted by the time since the
+ * previous one relative to battery_rate_avg_window_ms.  The average
+ * restarts when the battery switches between charging and
+ * discharging, and discharge below battery_ignore_discharge_rate
+ * counts as zero.
+ */
+static void
+portabook_battery_filter_rate(struct portabook_battery_info *info)
+{
+    unsigned long t = info->update_time[BATTINFO_PRESENT_RATE];
+    unsigned long window = msecs_to_jiffies(battery_rate_avg_window_ms);
+    int dir = info->state & (ACPI_BATTERY_STATE_DISCHARGING |
+			     ACPI_BATTERY_STATE_CHARGING);
+    int sample = info->rate_now;
+    unsigned long dt;
+
+    if (!t || t == info->rate_avg_time)
+	return;
+
+    if ((info->state & ACPI_BATTERY_STATE_DISCHARGING) &&
+	sample < battery_ignore_discharge_rate)
+	sample = 0;
+    sample <<= RATE_AVG_SHIFT;
+
+    dt = t - info->rate_avg_time;
+    if (!info->rate_avg_time || dir != info->rate_avg_dir || dt >= window)
+	info->rate_avg = sample;
+    else
+	info->rate_avg += div_s64((s64)(sample - info->rate_avg) * dt,
+				  window);
+    info->rate_avg_dir = dir;
+    info->rate_avg_time = t;
+}
+
+/*
+ * Publish INFO and tell userspace about meaningful changes since the
+ * last event.  Values are compared against the last reported copy,
+ * not the previous sample, so slow drifts still trip the hysteresis.
+ * Called with di->lock held.
+ */
+static void
+portabook_battery_update(struct portabook_battery *di,
+			 struct portabook_battery_info *info)
+{
+    const struct portabook_battery_info *old = &di->notified;
+    const struct portabook_battery_info *prev = &di->info;
+    int bat_changed = 0, ac_changed = 0;
+    int changed;
+
+    portabook_battery_filter_rate(info);
+    /* the EC relearns the full capacity around a charge */
+    if (prev->seq && !(info->expired & BATTINFO_STATIC) &&
+	((prev->state ^ info->state) & ACPI_BATTERY_STATE_CHARGING)) {
+	info->expired |= BATTINFO_STATIC;
+	atomic_or(BATTINFO_STATIC, &di->revalidate_mask);
+	portabook_battery_queue(di, &di->revalidate_work);
+    }
+    changed = !prev->seq ||
+	prev->ac_adapter != info->ac_adapter ||
+	prev->state != info->state ||
+	prev->rate_now != info->rate_now ||
+	prev->capacity_now != info->capacity_now ||
+	prev->voltage_now != info->voltage_now ||
+	prev->full_charge_capacity != info->full_charge_capacity;
+    if (changed)
+	info->seq = prev->seq + 1;
+    info->refresh_ns = ktime_get_ns();
+    portabook_battery_publish(di, info);
+    portabook_battery_share(di);
+    if (changed) {
+	atomic_long_set(&portabook_cdev_seq, info->seq);
+	wake_up_interruptible(&portabook_cdev_wait);
+    }
+
+    if (!di->notified_valid) {
+	di->notified = *info;
+	di->notified_valid = 1;
+	return;
+    }
+    if (!battery_notify || di->dying)
+	return;
+
+    if ((old->ac_adapter ^ info->ac_adapter) & 0x01)
+	ac_changed = 1;
+    if ((old->state ^ info->state) & BATTERY_STATE_MASK)
+	bat_changed = 1;
+    if (battery_notify_capacity_step &&
+	abs(portabook_battery_percent(old) -
+	    portabook_battery_percent(info)) >= battery_notify_capacity_step)
+	bat_changed = 1;
+    if (battery_notify_rate_hysteresis &&
+	abs(old->rate_now - info->rate_now) >=
+	battery_notify_rate_hysteresis)
+	bat_changed = 1;
+    if (battery_notify_voltage_hysteresis &&
+	abs(old->voltage_now - info->voltage_now) >=
+	battery_notify_voltage_hysteresis)
+	bat_changed = 1;
+
+    if (!bat_changed && !ac_changed)
+	return;
+    di->notified = *info;
+    /* status follows the AC state, so report the battery too */
+    if (di->bat)
+	power_supply_changed(di->bat);
+    if (ac_changed && di->ac)
+	power_supply_changed(di->ac);
+}
+
+/* cache time of field I in jiffies */
+static unsigned long
+portabook_battery_ttl(int i)
+{
+    enum portabook_battinfo_class class = portabook_battinfo_table[i].class;
+
+    return msecs_to_jiffies(*battinfo_class_ttl[class]);
+}
+
+/* fields of MASK whose cached value has expired */
+PORTABOOK_TESTABLE unsigned int
+portabook_battery_stale(const struct portabook_battery_info *info,
+			unsigned int mask)
+{
+    unsigned int stale = 0;
+    int i;
+
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++) {
+	if (!(mask & (1 << i)))
+	    continue;
+	if (!info->update_time[i] || (info->expired & (1 << i)) ||
+	    time_after_eq(jiffies, info->update_time[i] +
+			  portabook_battery_ttl(i)))
+	    stale |= 1 << i;
+    }
+    return stale;
+}
+
+/*
+ * STALE plus the fields that would expire within battery_batch_slack_ms
+ * anyway.  Reading them now shares the bus wakeup with STALE instead
+ * of causing one of their own shortly after.
+ */
+static unsigned int
+portabook_battery_batch(const struct portabook_battery_info *info,
+			unsigned int stale)
+{
+    unsigned long slack = msecs_to_jiffies(battery_batch_slack_ms);
+    unsigned int due = 0;
+    int i;
+
+    if (!stale || !slack)
+	return stale;
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++) {
+	if ((stale & (1 << i)) || !info->update_time[i])
+	    continue;
+	if (time_after_eq(jiffies + slack, info->update_time[i] +
+			  portabook_battery_ttl(i)))
+	    due |= 1 << i;
+    }
+    if (due)
+	portabook_stats_inc(PORTABOOK_STAT_BATCH_EARLY);
+    return stale | due;
+}
+
+/*
+ * Whether the expired fields STALE may still be served while a
+ * background refresh runs: they were read before, were not
+ * invalidated, and are less than battery_revalidate_ms past their TTL.
+ */
+static int
+portabook_battery_revalidatable(const struct portabook_battery_info *info,
+				unsigned int stale)
+{
+    unsigned long grace = msecs_to_jiffies(battery_revalidate_ms);
+    int i;
+
+    if (!battery_revalidate_ms || (info->expired & stale))
+	return 0;
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++) {
+	if (!(stale & (1 << i)))
+	    continue;
+	if (!info->update_time[i] ||
+	    time_after_eq(jiffies, info->update_time[i] +
+			  portabook_battery_ttl(i) + grace))
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * Bookkeeping after each refresh, called with di->lock held.  After a
+ * failure the bus is left alone for an exponentially growing time so a
+ * wedged EC is not hammered by every reader.
+ */
+static void
+portabook_battery_bus_result(struct portabook_battery *di, int s)
+{
+    unsigned int delay;
+
+    if (s >= 0) {
+	if (di->fail_count)
+	    dev_info(di->dev, "EC is responding again after %d failures\n",
+		     di->fail_count);
+	di->fail_count = 0;
+	WRITE_ONCE(di->last_error, 0);
+	return;
+    }
+
+    di->fail_count++;
+    WRITE_ONCE(di->last_error, s);
+    delay = battery_backoff_ms << min(di->fail_count - 1, 16);
+    delay = min(delay, battery_backoff_max_ms);
+    di->retry_after = jiffies + msecs_to_jiffies(delay);
+    /* let mapped readers see the stale flag */
+    portabook_battery_share(di);
+    portabook_stats_inc(PORTABOOK_STAT_REFRESH_FAILED);
+    dev_warn_ratelimited(di->dev,
+			 "EC read failed (%d), %d in a row, retrying in %u ms\n",
+			 s, di->fail_count, delay);
+}
+
+/* whether the bus is being left alone after failures, under di->lock */
+static int
+portabook_battery_backing_off(struct portabook_battery *di)
+{
+    return di->fail_count && time_before(jiffies, di->retry_after);
+}
+
+/*
+ * Read status, rate and voltage straight from the EC for the profiler,
+ * ignoring the cache TTLs.  The four fields form one register run.
+ * The result is published like any other refresh.  CURRENT_MA is
+ * negative while charging.
+ */
+int
+portabook_battery_sample(struct portabook_battery *di,
+			 int *state, int *current_ma, int *voltage_mv)
+{
+    struct portabook_battery_info info;
     int s;
 
     mutex_lock(&di->lock);
-    if (di->update_time &&
-	time_before(jiffies, di->update_time +
-		             msecs_to_jiffies(battery_info_cache_time)))
-	goto success;
-
-    s = read_battinfo_reg(i2c_client, BATT_INFO_LAST_CAP_H, &buf[0]);
-    if (s < 0) goto error;
-    s = read_battinfo_reg(i2c_client, BATT_INFO_LAST_CAP_L, &buf[1]);
-    if (s < 0) goto error;
-    di->full_charge_capacity = (buf[0] << 8) | buf[1];
-
-    s = read_battinfo_reg(i2c_client, BATT_INFO_STATUS_H, &buf[0]);
-    if (s < 0) goto error;
-    s = read_battinfo_reg(i2c_client, BATT_INFO_STATUS_L, &buf[1]);
-    if (s < 0) goto error;
-    di->state = (buf[0] << 8) | buf[1];
-
-    s = read_battinfo_reg(i2c_client, BATT_INFO_PRESENT_RATE_H, &buf[0]);
-    if (s < 0) goto error;
-    s = read_battinfo_reg(i2c_client, BATT_INFO_PRESENT_RATE_L, &buf[1]);
-    if (s < 0) goto error;
-    di->rate_now = (buf[0] << 8) | buf[1];
-
-    s = read_battinfo_reg(i2c_client, BATT_INFO_REMAIN_CAP_H, &buf[0]);
-    if (s < 0) goto error;
-    s = read_battinfo_reg(i2c_client, BATT_INFO_REMAIN_CAP_L, &buf[1]);
-    if (s < 0) goto error;
-    di->capacity_now = (buf[0] << 8) | buf[1];
-    
-    s = read_battinfo_reg(i2c_client, BATT_INFO_PRESENT_VOLT_H, &buf[0]);
-    if (s < 0) goto error;
-    s = read_battinfo_reg(i2c_client, BATT_INFO_PRESENT_VOLT_L, &buf[1]);
-    if (s < 0) goto error;
-    di->voltage_now = (buf[0] << 8) | buf[1];
-
-    s = read_battinfo_reg(i2c_client, BATT_INFO_AC_ADAPTER, &buf[0]);
-    if (s < 0) goto error;
-    di->ac_adapter = buf[0];
-    
-    di->update_time = jiffies;
-    
- success:
+    if (di->suspended || portabook_battery_backing_off(di)) {
+	s = -EAGAIN;
+	goto out;
+    }
+    portabook_battery_snapshot(di, &info);
+    s = portabook_battery_fetch(di, &info,
+				BATTINFO_F(STATUS) | BATTINFO_F(PRESENT_RATE) |
+				BATTINFO_F(REMAIN_CAP) |
+				BATTINFO_F(PRESENT_VOLT));
+    portabook_battery_bus_result(di, s);
+    if (s)
+	goto out;
+    portabook_battery_update(di, &info);
+    *state = info.state;
+    *current_ma = (info.state & ACPI_BATTERY_STATE_CHARGING) ?
+	-info.rate_now : info.rate_now;
+    *voltage_mv = info.voltage_now;
+ out:
     mutex_unlock(&di->lock);
-    return 0;
-	
- error:
+    return s;
+}
+
+/*
+ * Refresh the fields readers asked for in the background.  The work
+ * item is queued at most once, so however many readers hit an expired
+ * value only one refresh goes to the bus.
+ */
+static void
+portabook_battery_revalidate_work(struct work_struct *work)
+{
+    struct portabook_battery *di =
+	container_of(work, struct portabook_battery, revalidate_work);
+    struct portabook_battery_info info;
+    unsigned int stale;
+    int s;
+
+    mutex_lock(&di->lock);
+    portabook_battery_snapshot(di, &info);
+    stale = portabook_battery_stale(&info,
+				    atomic_xchg(&di->revalidate_mask, 0));
+    if (stale && !di->suspended && !portabook_battery_backing_off(di)) {
+	s = portabook_battery_fetch(di, &info,
+				    portabook_battery_batch(&info, stale));
+	portabook_battery_bus_result(di, s);
+	if (s == 0)
+	    portabook_battery_update(di, &info);
+    }
     mutex_unlock(&di->lock);
-    dev_warn(&di->i2c_client->dev, "call to read_battinfo_reg failed\n");
-    return 1;
 }
 
+/*
+ * Refresh the expired fields of MASK, 0 or a negative errno.  Values
+ * only slightly past their TTL are returned as they are and refreshed
+ * by portabook_battery_revalidate_work(); the caller waits for the bus
+ * only when nothing usable is cached.
+ */
+static int
+portabook_battery_read_status(struct portabook_battery *di,
+			      unsigned int mask)
+{
+    struct portabook_battery_info info;
+    unsigned int stale;
+    ktime_t start;
+    int s;
+
+    portabook_battery_snapshot(di, &info);
+    stale = portabook_battery_stale(&info, mask);
+    if (!stale) {
+	trace_portabook_battery_refresh(mask, 0, 0, 0);
+	portabook_stats_cache(true);
+	return 0;
+    }
+    if (portabook_battery_revalidatable(&info, stale)) {
+	atomic_or(stale, &di->revalidate_mask);
+	portabook_battery_queue(di, &di->revalidate_work);
+	trace_portabook_battery_refresh(mask, 0, 0, 0);
+	portabook_stats_inc(PORTABOOK_STAT_REVALIDATE);
+	return 0;
+    }
+
+    start = ktime_get();
+    mutex_lock(&di->lock);
+    portabook_stats_lock_wait(ktime_to_ns(ktime_sub(ktime_get(), start)));
+    /* somebody may have refreshed while we waited for the lock */
+    portabook_battery_snapshot(di, &info);
+    stale = portabook_battery_stale(&info, mask);
+    if (!stale) {
+	trace_portabook_battery_refresh(mask, 0, 0, 0);
+	portabook_stats_cache(true);
+	s = 0;
+	goto out;
+    }
+    portabook_stats_cache(false);
+    /* the controller may already be suspended; serve what we have */
+    if (di->suspended) {
+	s = -EAGAIN;
+	goto out;
+    }
+    if (portabook_battery_backing_off(di)) {
+	portabook_stats_inc(PORTABOOK_STAT_BACKOFF_SKIPPED);
+	s = -EAGAIN;
+	goto out;
+    }
+
+    s = portabook_battery_fetch(di, &info,
+				portabook_battery_batch(&info, stale));
+    portabook_battery_bus_result(di, s);
+    if (s == 0)
+	portabook_battery_update(di, &info);
+
+ out:
+    mutex_unlock(&di->lock);
+    return s;
+}
+
+/*
+ * Copy the current battery data into INFO, refreshing the fields in
+ * MASK first if they expired.  In polling mode the data is kept
+ * fresh by portabook_battery_poll_work() and no bus I/O is done here,
+ * except for fields that were never read: then the caller waits for
+ * the refresh like in on-demand mode.
+ *
+ * When the EC is failing, INFO still gets the last good values and
+ * they are accepted until battery_stale_limit_ms has passed; after
+ * that, or if a field was never read, the error is returned.
+ */
 static int
-portabook_battery_is_charged(struct portabook_battery *battery)
+portabook_battery_get_info(struct portabook_battery *di,
+			   unsigned int mask,
+			   struct portabook_battery_info *info)
+{
+    unsigned long limit = msecs_to_jiffies(battery_stale_limit_ms);
+    int unread = 0;
+    int s = 0;
+    int i;
+
+    portabook_battery_snapshot(di, info);
+    if (!mask)
+	return 0;
+    /* nothing to serve before the first refresh, even when polling */
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++)
+	if ((mask & (1 << i)) && !info->update_time[i])
+	    unread = 1;
+    if (!battery_poll_interval || unread)
+	s = portabook_battery_read_status(di, mask);
+    else
+	s = READ_ONCE(di->last_error);
+    portabook_battery_snapshot(di, info);
+    if (s == 0)
+	return 0;
+
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++) {
+	if (!(mask & (1 << i)))
+	    continue;
+	if (!info->update_time[i] ||
+	    (battery_stale_limit_ms &&
+	     time_after(jiffies, info->update_time[i] + limit)))
+	    return s;
+    }
+    portabook_stats_inc(PORTABOOK_STAT_STALE_SERVED);
+    return 0;
+}
+
+/* background refresh interval for the state in INFO */
+static unsigned int
+portabook_battery_poll_delay(const struct portabook_battery_info *info)
+{
+    if (!battery_poll_adaptive)
+	return battery_poll_interval;
+
+    if (info->state & (ACPI_BATTERY_STATE_CHARGING |
+		       ACPI_BATTERY_STATE_CRITICAL) ||
+	info->capacity_now <= DESIGN_NEAR_WARN_CAPACITY ||
+	info->rate_now >= battery_poll_fast_rate)
+	return battery_poll_fast_interval;
+    if ((info->ac_adapter & 0x01) &&
+	!(info->state & ACPI_BATTERY_STATE_DISCHARGING))
+	return battery_poll_slow_interval;
+    return battery_poll_interval;
+}
+
+static void
+portabook_battery_poll_work(struct work_struct *work)
+{
+    struct portabook_battery *di =
+	container_of(to_delayed_work(work), struct portabook_battery,
+		     poll_work);
+    struct portabook_battery_info info;
+    unsigned int delay;
+    ktime_t start;
+    int s;
+
+    if (!battery_poll_interval)
+	return;
+
+    start = ktime_get();
+    mutex_lock(&di->lock);
+    portabook_stats_lock_wait(ktime_to_ns(ktime_sub(ktime_get(), start)));
+    if (di->suspended) {
+	/* resume restarts us */
+	mutex_unlock(&di->lock);
+	return;
+    }
+    portabook_battery_snapshot(di, &info);
+    /* the full capacity only when it is due */
+    s = portabook_battery_fetch(di, &info,
+				(BATTINFO_ALL & ~BATTINFO_STATIC) |
+				portabook_battery_stale(&info, BATTINFO_STATIC));
+    portabook_battery_bus_result(di, s);
+    if (s == 0)
+	portabook_battery_update(di, &info);
+    /* fire together with other whole-second timers */
+    delay = round_jiffies_relative(
+	msecs_to_jiffies(portabook_battery_poll_delay(&info)));
+    if (portabook_battery_backing_off(di))
+	delay = max_t(unsigned long, delay, di->retry_after - jiffies);
+    mutex_unlock(&di->lock);
+
+    schedule_delayed_work(&di->poll_work, delay);
+}
+
+/*
+ * Refresh everything once after probe or resume, then start the
+ * poller.  Readers arriving meanwhile find the data stale and wait on
+ * di->lock for this refresh instead of starting their own.
+ */
+static void
+portabook_battery_refresh_work(struct work_struct *work)
+{
+    struct portabook_battery *di =
+	container_of(work, struct portabook_battery, refresh_work);
+    struct portabook_battery_info info;
+    int s;
+
+    mutex_lock(&di->lock);
+    portabook_battery_snapshot(di, &info);
+    if (portabook_battery_stale(&info, BATTINFO_ALL)) {
+	s = portabook_battery_fetch(di, &info, BATTINFO_ALL);
+	portabook_battery_bus_result(di, s);
+	if (s == 0)
+	    portabook_battery_update(di, &info);
+    }
+    mutex_unlock(&di->lock);
+
+    if (battery_poll_interval)
+	schedule_delayed_work(&di->poll_work,
+			      msecs_to_jiffies(portabook_battery_poll_delay(&info)));
+}
+
+/*
+ * Re-read the fields a power source event touched, whatever their
+ * age, and report the change.  They are marked expired first so that
+ * readers wait for the new values instead of being served the old
+ * ones.
+ */
+static void
+portabook_battery_event_work(struct work_struct *work)
+{
+    struct portabook_battery *di =
+	container_of(work, struct portabook_battery, event_work);
+    struct portabook_battery_info info;
+    unsigned int mask;
+    int s;
+
+    mutex_lock(&di->lock);
+    mask = atomic_xchg(&di->event_mask, 0);
+    /* resume re-reads everything anyway */
+    if (!mask || di->suspended)
+	goto out;
+    portabook_stats_inc(PORTABOOK_STAT_EVENT);
+    portabook_battery_snapshot(di, &info);
+    info.expired |= mask;
+    portabook_battery_publish(di, &info);
+    /* an event is a good reason to retry a failing EC early */
+    s = portabook_battery_fetch(di, &info,
+				portabook_battery_batch(&info, mask));
+    portabook_battery_bus_result(di, s);
+    if (s == 0)
+	portabook_battery_update(di, &info);
+ out:
+    mutex_unlock(&di->lock);
+}
+
+static void
+portabook_battery_queue_event(struct portabook_battery *di,
+			      enum portabook_event event)
+{
+    unsigned int mask;
+
+    if (event == PORTABOOK_EVENT_AC)
+	/* status follows the adapter */
+	mask = BATTINFO_F(AC_ADAPTER) | BATTINFO_F(STATUS);
+    else
+	/* one register run */
+	mask = BATTINFO_F(STATUS) | BATTINFO_F(PRESENT_RATE) |
+	    BATTINFO_F(REMAIN_CAP) | BATTINFO_F(PRESENT_VOLT);
+    atomic_or(mask, &di->event_mask);
+    portabook_battery_queue(di, &di->event_work);
+}
+
+/*
+ * Tell the driver that the power source changed, so that it does not
+ * wait for the next poll or cache expiry.  Process context only: the
+ * seqlock's spinlock is taken without disabling interrupts or bottom
+ * halves, here and by the writers.
+ */
+void
+portabook_battery_event(enum portabook_event event)
+{
+    struct portabook_battery *di = __portabook_battery_di;
+
+    if (di)
+	portabook_battery_queue_event(di, event);
+}
+
+#ifdef CONFIG_ACPI
+/*
+ * Firmware usually notifies the ACPI AC adapter and battery devices
+ * when the adapter is plugged or the battery goes critical.  Whether
+ * the Portabook's does has not been verified; its ACPI battery methods
+ * do not describe this battery, which is why this driver exists.  So
+ * listen to those notifications, next to whatever driver is bound to
+ * the devices, as a hint on top of polling and cache expiry.
+ */
+static const struct {
+    const char *hid;
+    enum portabook_event event;
+} portabook_acpi_sources[] = {
+    { "ACPI0003", PORTABOOK_EVENT_AC },
+    { "PNP0C0A",  PORTABOOK_EVENT_BATTERY },
+};
+
+static acpi_handle portabook_acpi_handles[ARRAY_SIZE(portabook_acpi_sources)];
+
+static void
+portabook_battery_acpi_notify(acpi_handle handle, u32 event, void *data)
+{
+    struct portabook_battery *di = data;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(portabook_acpi_sources); i++)
+	if (portabook_acpi_handles[i] == handle)
+	    portabook_battery_queue_event(di, portabook_acpi_sources[i].event);
+}
+
+static acpi_status
+portabook_battery_acpi_find(acpi_handle handle, u32 level, void *context,
+			    void **ret)
+{
+    *ret = handle;
+    return AE_CTRL_TERMINATE;
+}
+
+static void
+portabook_battery_acpi_init(struct portabook_battery *di)
+{
+    acpi_handle handle;
+    acpi_status status;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(portabook_acpi_sources); i++) {
+	handle = NULL;
+	acpi_get_devices(portabook_acpi_sources[i].hid,
+			 portabook_battery_acpi_find, NULL, &handle);
+	if (!handle)
+	    continue;
+	/* set before installing, the handler looks it up */
+	portabook_acpi_handles[i] = handle;
+	status = acpi_install_notify_handler(handle, ACPI_DEVICE_NOTIFY,
+					     portabook_battery_acpi_notify, di);
+	if (ACPI_FAILURE(status)) {
+	    portabook_acpi_handles[i] = NULL;
+	    dev_warn(di->dev, "cannot listen to %s notifications\n",
+		     portabook_acpi_sources[i].hid);
+	}
+    }
+}
+
+static void
+portabook_battery_acpi_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(portabook_acpi_sources); i++) {
+	if (!portabook_acpi_handles[i])
+	    continue;
+	/* waits for handlers already running */
+	acpi_remove_notify_handler(portabook_acpi_handles[i],
+				   ACPI_DEVICE_NOTIFY,
+				   portabook_battery_acpi_notify);
+	portabook_acpi_handles[i] = NULL;
+    }
+}
+#else
+static void portabook_battery_acpi_init(struct portabook_battery *di) { }
+static void portabook_battery_acpi_cleanup(void) { }
+#endif
+
+#ifdef CONFIG_PM_SLEEP
+static void
+portabook_battery_suspend(struct portabook_battery *di)
+{
+    /* keep readers, notifications and the profiler off the bus */
+    mutex_lock(&di->lock);
+    read_seqlock_excl(&di->seqlock);
+    di->suspended = true;
+    read_sequnlock_excl(&di->seqlock);
+    mutex_unlock(&di->lock);
+
+    cancel_work_sync(&di->refresh_work);
+    cancel_work_sync(&di->revalidate_work);
+    cancel_work_sync(&di->event_work);
+    cancel_delayed_work_sync(&di->poll_work);
+}
+
+/*
+ * jiffies stand still across suspend, so the cached values would look
+ * as fresh as before; expire them explicitly and refresh in the
+ * background without holding up the resume path.
+ */
+static void
+portabook_battery_resume(struct portabook_battery *di)
+{
+    struct portabook_battery_info info;
+
+    mutex_lock(&di->lock);
+    portabook_battery_snapshot(di, &info);
+    info.expired = BATTINFO_ALL;
+    /* the time since the last rate sample is unknown */
+    info.rate_avg_time = 0;
+    portabook_battery_publish(di, &info);
+    /* give the EC a fresh chance after a failure before suspend */
+    di->fail_count = 0;
+    read_seqlock_excl(&di->seqlock);
+    di->suspended = false;
+    read_sequnlock_excl(&di->seqlock);
+    mutex_unlock(&di->lock);
+
+    schedule_work(&di->refresh_work);
+}
+#endif
+
+PORTABOOK_TESTABLE int
+portabook_battery_is_charged(const struct portabook_battery_info *battery)
 {
     /* charging or discharing with high rate */
     if (battery->state & ACPI_BATTERY_STATE_CHARGING)
@@ -247,27 +1319,104 @@ portabook_battery_is_charged(struct portabook_battery *battery)
     return 0;
 }
 
+PORTABOOK_TESTABLE int
+portabook_battery_status(const struct portabook_battery_info *battery)
+{
+    if (battery->state & ACPI_BATTERY_STATE_DISCHARGING &&
+	battery->rate_now >= battery_ignore_discharge_rate)
+	return POWER_SUPPLY_STATUS_DISCHARGING;
+    if (battery->state & ACPI_BATTERY_STATE_CHARGING)
+	return POWER_SUPPLY_STATUS_CHARGING;
+    if (portabook_battery_is_charged(battery))
+	return POWER_SUPPLY_STATUS_FULL;
+    return POWER_SUPPLY_STATUS_UNKNOWN;
+}
+
+PORTABOOK_TESTABLE int
+portabook_battery_capacity_level(const struct portabook_battery_info *battery)
+{
+    if (battery->state & ACPI_BATTERY_STATE_CRITICAL)
+	return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+    if (battery->capacity_now <= DESIGN_WARN_CAPACITY)
+	return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+    if (portabook_battery_is_charged(battery))
+	return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+    return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+}
+
+/* seconds from the averaged rate, -1 when not discharging/charging */
+static int
+portabook_battery_time_to_empty(const struct portabook_battery_info *battery)
+{
+    int rate = battery->rate_avg >> RATE_AVG_SHIFT;
+
+    if (!(battery->state & ACPI_BATTERY_STATE_DISCHARGING) || rate <= 0)
+	return -1;
+    return battery->capacity_now * 3600 / rate;
+}
+
+static int
+portabook_battery_time_to_full(const struct portabook_battery_info *battery)
+{
+    int rate = battery->rate_avg >> RATE_AVG_SHIFT;
+
+    if (!(battery->state & ACPI_BATTERY_STATE_CHARGING) || rate <= 0)
+	return -1;
+    return max(battery->full_charge_capacity - battery->capacity_now, 0) *
+	3600 / rate;
+}
+
+/* fields a battery property is computed from */
+static unsigned int
+portabook_battery_prop_fields(enum power_supply_property psp)
+{
+    switch (psp) {
+    case POWER_SUPPLY_PROP_STATUS:
+    case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
+	return BATTINFO_F(STATUS) | BATTINFO_F(PRESENT_RATE) |
+	    BATTINFO_F(REMAIN_CAP) | BATTINFO_F(LAST_CAP);
+    case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+	return BATTINFO_F(PRESENT_VOLT);
+    case POWER_SUPPLY_PROP_CURRENT_NOW:
+    case POWER_SUPPLY_PROP_CURRENT_AVG:
+	return BATTINFO_F(STATUS) | BATTINFO_F(PRESENT_RATE);
+    case POWER_SUPPLY_PROP_POWER_NOW:
+	return BATTINFO_F(PRESENT_RATE) | BATTINFO_F(PRESENT_VOLT);
+    case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
+    case POWER_SUPPLY_PROP_TIME_TO_FULL_AVG:
+	return BATTINFO_F(STATUS) | BATTINFO_F(PRESENT_RATE) |
+	    BATTINFO_F(REMAIN_CAP) | BATTINFO_F(LAST_CAP);
+    case POWER_SUPPLY_PROP_CHARGE_FULL:
+    case POWER_SUPPLY_PROP_ENERGY_FULL:
+	return BATTINFO_F(LAST_CAP);
+    case POWER_SUPPLY_PROP_CHARGE_NOW:
+    case POWER_SUPPLY_PROP_ENERGY_NOW:
+	return BATTINFO_F(REMAIN_CAP);
+    case POWER_SUPPLY_PROP_CAPACITY:
+	return BATTINFO_F(REMAIN_CAP) | BATTINFO_F(LAST_CAP);
+    default:
+	return 0;
+    }
+}
+
 static int
 portabook_battery_get_property(struct power_supply *psy,
 			       enum power_supply_property psp,
 			       union power_supply_propval *val)
 {
     int ret = 0;
-    struct portabook_battery *battery = power_supply_get_drvdata(psy);
+    struct portabook_battery *di = power_supply_get_drvdata(psy);
+    struct portabook_battery_info info, *battery = &info;
     
-    portabook_battery_read_status(battery);
+    portabook_stats_prop(PORTABOOK_SUPPLY_BATTERY, psp);
+    ret = portabook_battery_get_info(di, portabook_battery_prop_fields(psp),
+				     &info);
+    if (ret)
+	return ret;
     
     switch (psp) {
     case POWER_SUPPLY_PROP_STATUS:
-	if (battery->state & ACPI_BATTERY_STATE_DISCHARGING &&
-	    battery->rate_now >= battery_ignore_discharge_rate)
-	    val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
-	else if (battery->state & ACPI_BATTERY_STATE_CHARGING)
-	    val->intval = POWER_SUPPLY_STATUS_CHARGING;
-	else if (portabook_battery_is_charged(battery))
-	    val->intval = POWER_SUPPLY_STATUS_FULL;
-	else
-	    val->intval = POWER_SUPPLY_STATUS_UNKNOWN;
+	val->intval = portabook_battery_status(battery);
 	break;
 	
     case POWER_SUPPLY_PROP_PRESENT:
@@ -283,10 +1432,30 @@ portabook_battery_get_property(struct power_supply *psy,
 	break;
 	
     case POWER_SUPPLY_PROP_CURRENT_NOW:
-    case POWER_SUPPLY_PROP_POWER_NOW:
 	val->intval = battery->rate_now * 1000;
 	break;
 	
+    case POWER_SUPPLY_PROP_CURRENT_AVG:
+	val->intval = (battery->rate_avg >> RATE_AVG_SHIFT) * 1000;
+	break;
+	
+    case POWER_SUPPLY_PROP_POWER_NOW:
+	/* mA * mV = uW */
+	val->intval = battery->rate_now * battery->voltage_now;
+	break;
+	
+    case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
+	val->intval = portabook_battery_time_to_empty(battery);
+	if (val->intval < 0)
+	    return -ENODATA;
+	break;
+	
+    case POWER_SUPPLY_PROP_TIME_TO_FULL_AVG:
+	val->intval = portabook_battery_time_to_full(battery);
+	if (val->intval < 0)
+	    return -ENODATA;
+	break;
+	
     case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
     case POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN:
 	val->intval = DESIGN_CAPACITY * 1000;
@@ -303,22 +1472,11 @@ portabook_battery_get_property(struct power_supply *psy,
 	break;
 	
     case POWER_SUPPLY_PROP_CAPACITY:
-	if (battery->capacity_now && battery->full_charge_capacity)
-	    val->intval = battery->capacity_now * 100 /
-		battery->full_charge_capacity;
-	else
-	    val->intval = 0;
+	val->intval = portabook_battery_percent(battery);
 	break;
 	
     case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
-	if (battery->state & ACPI_BATTERY_STATE_CRITICAL)
-	    val->intval = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
-	else if (battery->capacity_now <= DESIGN_WARN_CAPACITY)
-	    val->intval = POWER_SUPPLY_CAPACITY_LEVEL_LOW;
-	else if (portabook_battery_is_charged(battery))
-	    val->intval = POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-	else
-	    val->intval = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+	val->intval = portabook_battery_capacity_level(battery);
 	break;
 	
     default:
@@ -333,24 +1491,33 @@ static enum power_supply_property portabook_battery_props[] = {
     POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN,
     POWER_SUPPLY_PROP_VOLTAGE_NOW,
     POWER_SUPPLY_PROP_CURRENT_NOW,
+    POWER_SUPPLY_PROP_CURRENT_AVG,
+    POWER_SUPPLY_PROP_POWER_NOW,
     POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
     POWER_SUPPLY_PROP_CHARGE_FULL,
     POWER_SUPPLY_PROP_CHARGE_NOW,
     POWER_SUPPLY_PROP_CAPACITY,
     POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+    POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG,
+    POWER_SUPPLY_PROP_TIME_TO_FULL_AVG,
 };
 
-static struct portabook_battery *__portabook_battery_di;
 static int
 portabook_get_ac_property(struct power_supply *psy,
 			  enum power_supply_property psp,
 			  union power_supply_propval *val)
 {
-    struct portabook_battery *battery = __portabook_battery_di;
-    if (!battery)
+    struct portabook_battery *di = __portabook_battery_di;
+    struct portabook_battery_info info, *battery = &info;
+    int s;
+    if (!di)
 	return -ENODEV;
 
-    portabook_battery_read_status(battery);
+    portabook_stats_prop(PORTABOOK_SUPPLY_AC, psp);
+    /* one EC transaction on a cold cache, independent of the battery */
+    s = portabook_battery_get_info(di, BATTINFO_F(AC_ADAPTER), &info);
+    if (s)
+	return s;
     
     switch (psp) {
     case POWER_SUPPLY_PROP_ONLINE:
@@ -366,24 +1533,267 @@ static enum power_supply_property portabook_ac_props[] = {
     POWER_SUPPLY_PROP_ONLINE,
 };
 
+/*
+ * /dev/portabook: one struct portabook_snapshot per read(), see
+ * portabook_uapi.h.
+ */
+static bool portabook_cdev_registered;
+
+struct portabook_cdev_reader {
+    unsigned long seq;		/* last seq returned to this file */
+};
+
+static void
+portabook_battery_fill_snapshot(struct portabook_battery *di,
+				const struct portabook_battery_info *battery,
+				struct portabook_snapshot *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    snap->version		= PORTABOOK_SNAPSHOT_VERSION;
+    snap->size			= sizeof(*snap);
+    snap->seq			= battery->seq;
+    snap->timestamp_ns		= battery->refresh_ns;
+    snap->last_error		= READ_ONCE(di->last_error);
+    if (snap->last_error)
+	snap->flags |= PORTABOOK_SNAPSHOT_STALE;
+    snap->ac_online		= battery->ac_adapter & 0x01;
+    snap->status		= portabook_battery_status(battery);
+    snap->capacity		= portabook_battery_percent(battery);
+    snap->capacity_level	= portabook_battery_capacity_level(battery);
+    snap->voltage_now		= battery->voltage_now * 1000;
+    snap->current_now		= battery->rate_now * 1000;
+    snap->current_avg		= (battery->rate_avg >> RATE_AVG_SHIFT) * 1000;
+    snap->power_now		= battery->rate_now * battery->voltage_now;
+    snap->charge_now		= battery->capacity_now * 1000;
+    snap->charge_full		= battery->full_charge_capacity * 1000;
+    snap->charge_full_design	= DESIGN_CAPACITY * 1000;
+    snap->time_to_empty_avg	= portabook_battery_time_to_empty(battery);
+    snap->time_to_full_avg	= portabook_battery_time_to_full(battery);
+    snap->ec_state		= battery->state;
+}
+
 static int
-portabook_battery_probe(struct i2c_client *i2c_client,
-			const struct i2c_device_id *id)
+portabook_battery_get_snapshot(struct portabook_battery *di,
+			       struct portabook_snapshot *snap)
+{
+    struct portabook_battery_info info;
+    int s;
+
+    s = portabook_battery_get_info(di, BATTINFO_ALL, &info);
+    if (s)
+	return s;
+    portabook_battery_fill_snapshot(di, &info, snap);
+    return 0;
+}
+
+/*
+ * Copy the published data into the shared page, bracketed by an odd
+ * sequence count so mapped readers can detect a torn copy.  Called
+ * with di->lock held.
+ */
+static void
+portabook_battery_share(struct portabook_battery *di)
+{
+    struct portabook_shared *sh = di->shared;
+    struct portabook_snapshot snap;
+
+    if (!sh)
+	return;
+    portabook_battery_fill_snapshot(di, &di->info, &snap);
+    WRITE_ONCE(sh->seq, sh->seq + 1);
+    smp_wmb();
+    sh->snap = snap;
+    smp_wmb();
+    WRITE_ONCE(sh->seq, sh->seq + 1);
+}
+
+static int
+portabook_cdev_ready(struct portabook_cdev_reader *r)
+{
+    return !READ_ONCE(__portabook_battery_di) ||
+	atomic_long_read(&portabook_cdev_seq) != r->seq;
+}
+
+static ssize_t
+portabook_cdev_read(struct file *file, char __user *buf, size_t count,
+		    loff_t *ppos)
+{
+    struct portabook_cdev_reader *r = file->private_data;
+    struct portabook_snapshot snap;
+    int s;
+
+    if (count < sizeof(snap))
+	return -EINVAL;
+
+    for (;;) {
+	down_read(&portabook_cdev_sem);
+	if (__portabook_battery_di)
+	    s = portabook_battery_get_snapshot(__portabook_battery_di, &snap);
+	else
+	    s = -ENODEV;
+	up_read(&portabook_cdev_sem);
+	if (s)
+	    return s;
+	if (snap.seq != r->seq)
+	    break;
+
+	if (file->f_flags & O_NONBLOCK)
+	    return -EAGAIN;
+	s = wait_event_interruptible(portabook_cdev_wait,
+				     portabook_cdev_ready(r));
+	if (s)
+	    return s;
+    }
+
+    if (copy_to_user(buf, &snap, sizeof(snap)))
+	return -EFAULT;
+    r->seq = snap.seq;
+    return sizeof(snap);
+}
+
+static unsigned int
+portabook_cdev_poll(struct file *file, poll_table *wait)
+{
+    struct portabook_cdev_reader *r = file->private_data;
+
+    poll_wait(file, &portabook_cdev_wait, wait);
+    if (!READ_ONCE(__portabook_battery_di))
+	return POLLERR | POLLHUP;
+    if (atomic_long_read(&portabook_cdev_seq) != r->seq)
+	return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+/*
+ * Map the shared page read-only.  vm_insert_page() holds a reference,
+ * so the page outlives the battery device for mappings still around.
+ */
+static int
+portabook_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int s = -ENODEV;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+	return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+	return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    down_read(&portabook_cdev_sem);
+    if (__portabook_battery_di && __portabook_battery_di->shared)
+	s = vm_insert_page(vma, vma->vm_start,
+			   virt_to_page(__portabook_battery_di->shared));
+    up_read(&portabook_cdev_sem);
+    return s;
+}
+
+static int
+portabook_cdev_open(struct inode *inode, struct file *file)
+{
+    struct portabook_cdev_reader *r;
+
+    r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+	return -ENOMEM;
+    file->private_data = r;
+    return nonseekable_open(inode, file);
+}
+
+static int
+portabook_cdev_release(struct inode *inode, struct file *file)
+{
+    kfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations portabook_cdev_fops = {
+    .owner   = THIS_MODULE,
+    .open    = portabook_cdev_open,
+    .release = portabook_cdev_release,
+    .read    = portabook_cdev_read,
+    .poll    = portabook_cdev_poll,
+    .mmap    = portabook_cdev_mmap,
+    .llseek  = no_llseek,
+};
+
+static struct miscdevice portabook_cdev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = "portabook",
+    .fops  = &portabook_cdev_fops,
+    .mode  = 0444,
+};
+
+static int
+portabook_battery_bus_show(struct seq_file *m, void *v)
+{
+    struct portabook_battery *di = m->private;
+    struct portabook_battery_info info;
+    unsigned long oldest = jiffies;
+    int i;
+
+    mutex_lock(&di->lock);
+    portabook_battery_snapshot(di, &info);
+    seq_printf(m, "last_error %d\n", di->last_error);
+    seq_printf(m, "fail_count %d\n", di->fail_count);
+    seq_printf(m, "backoff_ms %u\n", portabook_battery_backing_off(di) ?
+	       jiffies_to_msecs(di->retry_after - jiffies) : 0);
+    mutex_unlock(&di->lock);
+
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++)
+	if (info.update_time[i] && time_before(info.update_time[i], oldest))
+	    oldest = info.update_time[i];
+    seq_printf(m, "data_age_ms %u\n", jiffies_to_msecs(jiffies - oldest));
+    return 0;
+}
+
+static int
+portabook_battery_bus_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, portabook_battery_bus_show, inode->i_private);
+}
+
+static const struct file_operations portabook_battery_bus_fops = {
+    .owner   = THIS_MODULE,
+    .open    = portabook_battery_bus_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * Register the battery and AC supplies under DEV, reading the EC
+ * through OPS.  Shared by the I2C driver and the emulator.
+ */
+static struct portabook_battery *
+portabook_battery_setup(struct device *dev,
+			const struct portabook_ec_ops *ops, void *ctx)
 {
     struct power_supply_config psy_cfg = {};
     int retval = 0;
     struct portabook_battery *di;
     
-    di = devm_kzalloc(&i2c_client->dev, sizeof(*di), GFP_KERNEL);
+    di = devm_kzalloc(dev, sizeof(*di), GFP_KERNEL);
     if (!di) {
 	retval = -ENOMEM;
 	goto di_alloc_failed;
     }
     
-    i2c_set_clientdata(i2c_client, di);
-    
     mutex_init(&di->lock);
-    di->i2c_client		= i2c_client;
+    seqlock_init(&di->seqlock);
+    /* an idle CPU need not wake up just to poll */
+    INIT_DEFERRABLE_WORK(&di->poll_work, portabook_battery_poll_work);
+    INIT_WORK(&di->refresh_work, portabook_battery_refresh_work);
+    INIT_WORK(&di->revalidate_work, portabook_battery_revalidate_work);
+    atomic_set(&di->revalidate_mask, 0);
+    INIT_WORK(&di->event_work, portabook_battery_event_work);
+    atomic_set(&di->event_mask, 0);
+    di->dev			= dev;
+    di->ec_ops			= ops;
+    di->ec_ctx			= ctx;
     
     di->ac_desc.name		= "portabook_ac";
     di->ac_desc.type		= POWER_SUPPLY_TYPE_MAINS;
@@ -393,7 +1803,7 @@ portabook_battery_probe(struct i2c_client *i2c_client,
     
     __portabook_battery_di	= di;
     
-    di->ac = power_supply_register(&di->i2c_client->dev, &di->ac_desc, NULL);
+    di->ac = power_supply_register(di->dev, &di->ac_desc, NULL);
     if (IS_ERR(di->ac)) {
 	retval = PTR_ERR(di->ac);
 	goto ac_failed;
@@ -407,33 +1817,153 @@ portabook_battery_probe(struct i2c_client *i2c_client,
     
     psy_cfg.drv_data		= di;
     
-    di->bat = power_supply_register(&i2c_client->dev, &di->bat_desc, &psy_cfg);
+    di->bat = power_supply_register(di->dev, &di->bat_desc, &psy_cfg);
     if (IS_ERR(di->bat)) {
-	dev_err(&di->i2c_client->dev, "failed to register battery\n");
+	dev_err(di->dev, "failed to register battery\n");
 	retval = PTR_ERR(di->bat);
 	goto batt_failed;
     }
     
-    portabook_battery_read_status(di);
-    return retval;
+    if (portabook_debugfs_dir())
+	di->debugfs = debugfs_create_file("battery_bus", 0444,
+					  portabook_debugfs_dir(), di,
+					  &portabook_battery_bus_fops);
+    portabook_profile_init(di);
 
-batt_failed:
-    power_supply_unregister(di->ac);
+    /* the supplies work without it, so only warn */
+    di->shared = (struct portabook_shared *)get_zeroed_page(GFP_KERNEL);
+    retval = misc_register(&portabook_cdev);
+    if (retval)
+	dev_warn(di->dev, "cannot register /dev/portabook (%d)\n", retval);
+    portabook_cdev_registered = !retval;
+
+    /* the host's power source events say nothing about the emulator */
+    if (!portabook_emu_enabled())
+	portabook_battery_acpi_init(di);
+
+    /* keep the first 11 register reads off the probe path */
+    schedule_work(&di->refresh_work);
+    return di;
 
+batt_failed:
  ac_failed:
+    read_seqlock_excl(&di->seqlock);
+    di->dying = true;
+    read_sequnlock_excl(&di->seqlock);
+    down_write(&portabook_cdev_sem);
+    __portabook_battery_di = NULL;
+    up_write(&portabook_cdev_sem);
+    /* a poll interval write may have started the poller meanwhile */
+    cancel_delayed_work_sync(&di->poll_work);
+    if (!IS_ERR(di->ac))
+	power_supply_unregister(di->ac);
 di_alloc_failed:
-    return retval;
+    return ERR_PTR(retval);
+}
+
+static void
+portabook_battery_teardown(struct portabook_battery *di)
+{
+    struct power_supply *bat, *ac;
+
+    /* stop queueing work and reporting changes to the supplies */
+    mutex_lock(&di->lock);
+    read_seqlock_excl(&di->seqlock);
+    di->dying = true;
+    read_sequnlock_excl(&di->seqlock);
+    bat = di->bat;
+    ac = di->ac;
+    di->bat = NULL;
+    di->ac = NULL;
+    mutex_unlock(&di->lock);
+
+    down_write(&portabook_cdev_sem);
+    __portabook_battery_di = NULL;
+    up_write(&portabook_cdev_sem);
+    wake_up_interruptible(&portabook_cdev_wait);
+    if (portabook_cdev_registered)
+	misc_deregister(&portabook_cdev);
+    portabook_cdev_registered = false;
+    portabook_battery_acpi_cleanup();
+    portabook_profile_cleanup();
+    debugfs_remove(di->debugfs);
+    cancel_work_sync(&di->refresh_work);
+    cancel_work_sync(&di->revalidate_work);
+    cancel_work_sync(&di->event_work);
+    cancel_delayed_work_sync(&di->poll_work);
+    if (di->shared) {
+	struct portabook_shared *sh;
+
+	/* mappings may outlive us; leave them marked stale */
+	mutex_lock(&di->lock);
+	WRITE_ONCE(di->last_error, -ENODEV);
+	portabook_battery_share(di);
+	/* refreshes until the supplies are gone must not touch it */
+	sh = di->shared;
+	di->shared = NULL;
+	mutex_unlock(&di->lock);
+	free_page((unsigned long)sh);
+    }
+    power_supply_unregister(ac);
+    power_supply_unregister(bat);
+    mutex_destroy(&di->lock);
+}
+
+/* the i2c_device_id argument went away in 6.3 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+static int
+portabook_battery_probe(struct i2c_client *i2c_client)
+#else
+static int
+portabook_battery_probe(struct i2c_client *i2c_client,
+			const struct i2c_device_id *id)
+#endif
+{
+    struct portabook_battery *di;
+
+    di = portabook_battery_setup(&i2c_client->dev,
+				 &portabook_ec_i2c_ops, i2c_client);
+    if (IS_ERR(di))
+	return PTR_ERR(di);
+    i2c_set_clientdata(i2c_client, di);
+    return 0;
 }
 
+/* and remove() returns void since 6.1 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+static void
+portabook_battery_remove(struct i2c_client *i2c_client)
+{
+    portabook_battery_teardown(i2c_get_clientdata(i2c_client));
+}
+#else
 static int
 portabook_battery_remove(struct i2c_client *i2c_client)
 {
-    struct portabook_battery *di = i2c_get_clientdata(i2c_client);
-    power_supply_unregister(di->ac);
-    power_supply_unregister(di->bat);
-    mutex_destroy(&di->lock);
+    portabook_battery_teardown(i2c_get_clientdata(i2c_client));
     return 0;
 }
+#endif
+
+#ifdef CONFIG_PM_SLEEP
+static int
+portabook_battery_pm_suspend(struct device *dev)
+{
+    portabook_battery_suspend(i2c_get_clientdata(to_i2c_client(dev)));
+    return 0;
+}
+
+static int
+portabook_battery_pm_resume(struct device *dev)
+{
+    portabook_battery_resume(i2c_get_clientdata(to_i2c_client(dev)));
+    return 0;
+}
+#endif
+
+static SIMPLE_DEV_PM_OPS(portabook_battery_pm_ops,
+			 portabook_battery_pm_suspend,
+			 portabook_battery_pm_resume);
 
 static struct i2c_device_id portabook_battery_idtable[] = {
     { I2C_DEVICE_NAME, -1 },
@@ -445,6 +1975,8 @@ static struct i2c_driver portabook_battery_driver = {
     .driver = {
 	.name  = I2C_DEVICE_NAME,
 	.owner = THIS_MODULE,
+	.pm    = &portabook_battery_pm_ops,
+	.probe_type = PROBE_PREFER_ASYNCHRONOUS,
     },
     .id_table = portabook_battery_idtable,
     .probe    = portabook_battery_probe,
@@ -457,42 +1989,77 @@ static struct i2c_board_info portabook_ext_info = {
 };
 
 static struct i2c_client *battery_i2c_client;
+static struct portabook_battery *battery_emu_di;
+
+/* the EC is on the DesignWare adapter with battery_adapter_uid */
+static int
+portabook_battery_adapter_found(struct device *dev)
+{
+    struct i2c_client *client;
+
+    client = i2c_new_client_device(i2c_verify_adapter(dev),
+				   &portabook_ext_info);
+    if (IS_ERR(client))
+	return PTR_ERR(client);
+    battery_i2c_client = client;
+    return 0;
+}
+
+/* the I2C core has already removed our client with the adapter */
+static void
+portabook_battery_adapter_lost(struct device *dev)
+{
+    battery_i2c_client = NULL;
+}
+
+static struct portabook_i2c_watch battery_adapter_watch = {
+    .hid     = I2C_ADAPTER_HID,
+    .adapter = true,
+    .found   = portabook_battery_adapter_found,
+    .lost    = portabook_battery_adapter_lost,
+};
 
 int
 portabook_battery_init(void)
 {
     int s;
-    int index;
-    struct i2c_adapter *adapter;
     
+    if (portabook_emu_enabled()) {
+	battery_emu_di = portabook_battery_setup(portabook_emu_device(),
+						 &portabook_emu_ec_ops, NULL);
+	if (IS_ERR(battery_emu_di)) {
+	    s = PTR_ERR(battery_emu_di);
+	    battery_emu_di = NULL;
+	    return s;
+	}
+	return 0;
+    }
+
     s = i2c_add_driver(&portabook_battery_driver);
     if (s < 0) return s;
 
-    index = 0;
-    while (1) {
-	adapter = i2c_get_adapter(index);
-	if (!adapter)
-	    goto detect_failed;
-	/* USE first founded adater */
-	if (!strcmp(adapter->name, I2C_ADAPTER_NAME))
-	    break;
-	i2c_put_adapter(adapter);
-	index++;
-    }
-    battery_i2c_client = i2c_new_device(adapter, &portabook_ext_info);
-    if (!battery_i2c_client)
+    if (battery_adapter_uid && *battery_adapter_uid)
+	battery_adapter_watch.uid = battery_adapter_uid;
+
+    s = portabook_i2c_watch_start(&battery_adapter_watch);
+    if (s < 0)
 	goto detect_failed;
-    i2c_put_adapter(adapter);
     return 0;
 
 detect_failed:
     i2c_del_driver(&portabook_battery_driver);
-    return -ENODEV;
+    return s;
 }
 
 void
 portabook_battery_cleanup(void)
 {
+    if (battery_emu_di) {
+	portabook_battery_teardown(battery_emu_di);
+	battery_emu_di = NULL;
+	return;
+    }
+    portabook_i2c_watch_stop(&battery_adapter_watch);
     if (battery_i2c_client)
 	i2c_unregister_device(battery_i2c_client);
     battery_i2c_client = NULL;
@@ -0,0 +1,138 @@
+/*
+ * portabook_battery.h - Portabook extra module, EC battery data
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * EC register map and the cached battery data, shared by
+ * portabook_battery.c and its tests.
+ */
+
+#ifndef __PORTABOOK_BATTERY_H__
+#define __PORTABOOK_BATTERY_H__
+
+#include <linux/types.h>
+
+#ifndef ACPI_BATTERY_STATE_DISCHARGING
+#define ACPI_BATTERY_STATE_DISCHARGING	(1 << 0)
+#endif
+#ifndef ACPI_BATTERY_STATE_CHARGING
+#define ACPI_BATTERY_STATE_CHARGING	(1 << 1)
+#endif
+#ifndef ACPI_BATTERY_STATE_CRITICAL
+#define ACPI_BATTERY_STATE_CRITICAL	(1 << 2)
+#endif
+#ifndef ACPI_BATTERY_VALUE_UNKNOWN
+#define ACPI_BATTERY_VALUE_UNKNOWN	0xFFFFFFFF
+#endif
+
+#define DESIGN_CAPACITY			4800	/* 4800 mAh */
+#define DESIGN_VOLTAGE			3800	/* 3.8V */
+#define DESIGN_WARN_CAPACITY		800	/* 800 mAh */
+#define DESIGN_NEAR_WARN_CAPACITY	1000	/* 1000 mAh */
+
+#define BATT_INDEX_CMD			0x82
+#define BATT_DATA_CMD			0x80
+
+#define	BATT_INFO_LAST_CAP_H		0x144
+#define	BATT_INFO_LAST_CAP_L		0x145
+#define	BATT_INFO_STATUS_H		0x1A0
+#define	BATT_INFO_STATUS_L		0x1A1
+#define	BATT_INFO_PRESENT_RATE_H	0x1A2
+#define	BATT_INFO_PRESENT_RATE_L	0x1A3
+#define	BATT_INFO_REMAIN_CAP_H		0x1A4
+#define	BATT_INFO_REMAIN_CAP_L		0x1A5
+#define	BATT_INFO_PRESENT_VOLT_H	0x1A6
+#define	BATT_INFO_PRESENT_VOLT_L	0x1A7
+#define BATT_INFO_AC_ADAPTER		0x10B
+
+/* values cached from the EC, in register order */
+enum portabook_battinfo_field {
+    BATTINFO_AC_ADAPTER,
+    BATTINFO_LAST_CAP,
+    BATTINFO_STATUS,
+    BATTINFO_PRESENT_RATE,
+    BATTINFO_REMAIN_CAP,
+    BATTINFO_PRESENT_VOLT,
+    BATTINFO_NUM_FIELDS,
+};
+
+#define BATTINFO_F(x)		(1 << BATTINFO_##x)
+#define BATTINFO_ALL		((1 << BATTINFO_NUM_FIELDS) - 1)
+
+/* how often each field changes, which decides its cache time */
+enum portabook_battinfo_class {
+    BATTINFO_CLASS_STATIC,	/* once per charge cycle */
+    BATTINFO_CLASS_STATE,	/* on plug/unplug and charge transitions */
+    BATTINFO_CLASS_FAST,	/* every second or so */
+    BATTINFO_NUM_CLASSES,
+};
+
+#define BATTINFO_STATIC		BATTINFO_F(LAST_CAP)
+
+/*
+ * portabook battery data, valid after a successful refresh.  A
+ * published copy is never modified in place; refreshers build a new
+ * one and swap it in under the seqlock.
+ */
+struct portabook_battery_info {
+    /* jiffies when each field was read, 0 if never */
+    unsigned long update_time[BATTINFO_NUM_FIELDS];
+    /* fields to re-read regardless of age, e.g. after resume */
+    unsigned int expired;
+    
+    int rate_now;
+    int capacity_now;
+    int voltage_now;
+    int full_charge_capacity;
+    int state;
+    int ac_adapter;
+
+    /* filtered rate_now in mA << RATE_AVG_SHIFT, see
+       portabook_battery_filter_rate() */
+    int rate_avg;
+    int rate_avg_dir;		/* charging/discharging bits it belongs to */
+    unsigned long rate_avg_time;	/* rate sample it includes, 0 if none */
+
+    unsigned long seq;		/* bumped when a value changes, 0 = no data */
+    u64 refresh_ns;		/* ktime_get_ns() of the last refresh */
+};
+
+#define RATE_AVG_SHIFT	8
+
+/* helpers portabook_test.c calls, see PORTABOOK_TESTABLE */
+#ifdef CONFIG_PORTABOOK_EXT_KUNIT_TEST
+extern unsigned int battery_info_cache_time;
+extern unsigned int ac_info_cache_time;
+extern unsigned int battery_full_cache_time;
+extern unsigned int battery_fullcharged_percentage;
+extern unsigned int battery_ignore_discharge_rate;
+
+extern void portabook_battinfo_decode(struct portabook_battery_info *info,
+				      int i, int run_reg, const u8 *buf,
+				      unsigned long now);
+extern unsigned int
+portabook_battery_stale(const struct portabook_battery_info *info,
+			unsigned int mask);
+extern int
+portabook_battery_is_charged(const struct portabook_battery_info *battery);
+extern int
+portabook_battery_status(const struct portabook_battery_info *battery);
+extern int
+portabook_battery_capacity_level(const struct portabook_battery_info *battery);
+#endif
+
+#endif /* __PORTABOOK_BATTERY_H__ */
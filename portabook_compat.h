@@ -0,0 +1,71 @@
+/*
+ * portabook_compat.h - Portabook extra module, kernel API differences
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * The module is written against 4.4, the kernel the Portabook ships
+ * with; the KUnit build needs 5.13 or later.  Calls that changed in
+ * between are bridged here and spelled the new way in the code;
+ * changed callback signatures are handled where they are defined.
+ */
+
+#ifndef __PORTABOOK_COMPAT_H__
+#define __PORTABOOK_COMPAT_H__
+
+#include <linux/version.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/i2c.h>
+
+/* i2c_new_device() returned NULL on failure and is gone since 5.8 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+static inline struct i2c_client *
+i2c_new_client_device(struct i2c_adapter *adap,
+		      struct i2c_board_info const *info)
+{
+    struct i2c_client *client = i2c_new_device(adap, info);
+
+    return client ? client : ERR_PTR(-ENODEV);
+}
+#endif
+
+/* bus_find_device() passes its data as const since 5.3 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
+#define PORTABOOK_MATCH_CONST const
+#else
+#define PORTABOOK_MATCH_CONST
+#endif
+
+/* hrtimer_init() was replaced by hrtimer_setup() in 6.13 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+static inline void
+hrtimer_setup(struct hrtimer *timer,
+	      enum hrtimer_restart (*function)(struct hrtimer *),
+	      clockid_t clock_id, enum hrtimer_mode mode)
+{
+    hrtimer_init(timer, clock_id, mode);
+    timer->function = function;
+}
+#endif
+
+/* a NULL llseek means the same since no_llseek was removed in 6.12 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#define no_llseek NULL
+#endif
+
+#endif /* __PORTABOOK_COMPAT_H__ */
@@ -0,0 +1,248 @@
+/*
+ * portabook_emu.c - Portabook EC/PMIC emulator
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * With emulate=1 the battery and backlight code run against an
+ * in-memory model of the EC register map and the PMIC backlight
+ * registers instead of I2C, so the driver can be exercised and
+ * measured on machines other than the Portabook.  Every transaction
+ * sleeps for emu_latency_us plus up to emu_jitter_us, and all of them
+ * are serialized as if they shared one bus.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/platform_device.h>
+#include <linux/string.h>
+
+#include "portabook.h"
+
+static bool emulate = 0;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate, "use the EC/PMIC emulator instead of hardware");
+
+static unsigned int emu_latency_us = 500;
+module_param(emu_latency_us, uint, 0644);
+MODULE_PARM_DESC(emu_latency_us, "emulated bus transaction latency in us");
+
+static unsigned int emu_jitter_us = 200;
+module_param(emu_jitter_us, uint, 0644);
+MODULE_PARM_DESC(emu_jitter_us, "maximum extra random latency in us");
+
+static bool emu_autoinc = 1;
+module_param(emu_autoinc, bool, 0644);
+MODULE_PARM_DESC(emu_autoinc,
+		 "read a run of EC registers in one transaction");
+
+/* emulated battery state, in the units the EC reports */
+static int emu_ac = 1;
+module_param(emu_ac, int, 0644);
+MODULE_PARM_DESC(emu_ac, "AC adapter register (0x10B)");
+
+static int emu_state = 0;
+module_param(emu_state, int, 0644);
+MODULE_PARM_DESC(emu_state, "battery state register (0x1A0)");
+
+static int emu_rate = 0;
+module_param(emu_rate, int, 0644);
+MODULE_PARM_DESC(emu_rate, "present rate in mA (0x1A2)");
+
+static int emu_capacity = 3600;
+module_param(emu_capacity, int, 0644);
+MODULE_PARM_DESC(emu_capacity, "remaining capacity in mAh (0x1A4)");
+
+static int emu_voltage = 3900;
+module_param(emu_voltage, int, 0644);
+MODULE_PARM_DESC(emu_voltage, "present voltage in mV (0x1A6)");
+
+static int emu_full = 4500;
+module_param(emu_full, int, 0644);
+MODULE_PARM_DESC(emu_full, "last full charge capacity in mAh (0x144)");
+
+static bool emu_ec_fail = 0;
+module_param(emu_ec_fail, bool, 0644);
+MODULE_PARM_DESC(emu_ec_fail, "make every EC transaction fail with -EIO");
+
+static int
+emu_event_set(const char *val, const struct kernel_param *kp)
+{
+    if (sysfs_streq(val, "ac"))
+	portabook_battery_event(PORTABOOK_EVENT_AC);
+    else if (sysfs_streq(val, "battery"))
+	portabook_battery_event(PORTABOOK_EVENT_BATTERY);
+    else
+	return -EINVAL;
+    return 0;
+}
+
+static const struct kernel_param_ops emu_event_ops = {
+    .set = emu_event_set,
+};
+module_param_cb(emu_event, &emu_event_ops, NULL, 0200);
+MODULE_PARM_DESC(emu_event,
+		 "write \"ac\" or \"battery\" to inject a power source "
+		 "notification, e.g. after changing emu_ac or emu_state");
+
+static DEFINE_MUTEX(emu_bus_lock);
+static struct platform_device *emu_pdev;
+static u8 emu_pmic_regs[256];
+
+static void
+emu_transaction(void)
+{
+    unsigned int us = emu_latency_us;
+
+    if (emu_jitter_us)
+	us += prandom_u32() % (emu_jitter_us + 1);
+    if (us)
+	usleep_range(us, us + 1);
+}
+
+static u8
+emu_ec_reg(int reg)
+{
+    switch (reg) {
+    case 0x10B: return emu_ac;
+    case 0x144: return emu_full >> 8;
+    case 0x145: return emu_full;
+    case 0x1A0: return emu_state >> 8;
+    case 0x1A1: return emu_state;
+    case 0x1A2: return emu_rate >> 8;
+    case 0x1A3: return emu_rate;
+    case 0x1A4: return emu_capacity >> 8;
+    case 0x1A5: return emu_capacity;
+    case 0x1A6: return emu_voltage >> 8;
+    case 0x1A7: return emu_voltage;
+    default:    return 0;
+    }
+}
+
+static int
+emu_ec_read(void *ctx, int reg, u8 *buf, int len)
+{
+    int i, xfers = 0;
+
+    mutex_lock(&emu_bus_lock);
+    if (emu_ec_fail) {
+	emu_transaction();
+	mutex_unlock(&emu_bus_lock);
+	return -EIO;
+    }
+    for (i = 0; i < len; i++) {
+	if (i == 0 || !emu_autoinc) {
+	    emu_transaction();
+	    xfers++;
+	}
+	buf[i] = emu_ec_reg(reg + i);
+    }
+    mutex_unlock(&emu_bus_lock);
+    return xfers;
+}
+
+#ifdef CONFIG_PORTABOOK_EXT_KUNIT_TEST
+/* the value behind the H (or only) register REG, for portabook_test.c */
+int *
+portabook_emu_ec_value(int reg)
+{
+    switch (reg) {
+    case 0x10B: return &emu_ac;
+    case 0x144: return &emu_full;
+    case 0x1A0: return &emu_state;
+    case 0x1A2: return &emu_rate;
+    case 0x1A4: return &emu_capacity;
+    case 0x1A6: return &emu_voltage;
+    default:    return NULL;
+    }
+}
+#endif
+
+const struct portabook_ec_ops portabook_emu_ec_ops = {
+    .read = emu_ec_read,
+};
+
+static int
+emu_pmic_readb(void *ctx, int reg, u8 *val)
+{
+    mutex_lock(&emu_bus_lock);
+    emu_transaction();
+    *val = emu_pmic_regs[reg & 0xff];
+    mutex_unlock(&emu_bus_lock);
+    return 0;
+}
+
+static int
+emu_pmic_write_seq(void *ctx, const struct portabook_reg_write *seq, int num)
+{
+    int i;
+
+    mutex_lock(&emu_bus_lock);
+    emu_transaction();
+    for (i = 0; i < num; i++)
+	emu_pmic_regs[seq[i].reg] = seq[i].val;
+    mutex_unlock(&emu_bus_lock);
+    return 0;
+}
+
+const struct portabook_pmic_ops portabook_emu_pmic_ops = {
+    .readb     = emu_pmic_readb,
+    .write_seq = emu_pmic_write_seq,
+};
+
+bool
+portabook_emu_enabled(void)
+{
+    return emu_pdev != NULL;
+}
+
+struct device *
+portabook_emu_device(void)
+{
+    return &emu_pdev->dev;
+}
+
+int
+portabook_emu_init(void)
+{
+    if (!emulate)
+	return 0;
+
+    /* backlight on at half brightness */
+    emu_pmic_regs[0x4B] = 0xFF;
+    emu_pmic_regs[0x4E] = 0x80;
+    emu_pmic_regs[0x51] = 0x01;
+
+    emu_pdev = platform_device_register_simple("portabook_emu", -1, NULL, 0);
+    if (IS_ERR(emu_pdev)) {
+	int error = PTR_ERR(emu_pdev);
+	emu_pdev = NULL;
+	return error;
+    }
+    printk("portabook_ext: using emulated EC and PMIC\n");
+    return 0;
+}
+
+void
+portabook_emu_cleanup(void)
+{
+    if (emu_pdev)
+	platform_device_unregister(emu_pdev);
+    emu_pdev = NULL;
+}
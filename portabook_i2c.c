@@ -0,0 +1,220 @@
+/*
+ * portabook_i2c.c - Portabook extra module, I2C device lookup
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * The EC sits on a DesignWare I2C adapter and the backlight on the
+ * INT33FD PMIC client, both enumerated from ACPI.  A watch finds such
+ * a device by its ACPI HID, and by its _UID where several devices
+ * share the HID.  If it is already registered the found
+ * callback runs before portabook_i2c_watch_start() returns;
+ * otherwise it runs from a work item once the device is added to the
+ * I2C bus, so loading early in boot does not race the adapter.
+ *
+ * A window holds the controller behind a client awake across several
+ * transfers, see portabook_i2c_window_open().
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/acpi.h>
+#include <linux/i2c.h>
+#include <linux/pm_runtime.h>
+
+#include "portabook.h"
+#include "portabook_compat.h"
+
+static int
+portabook_i2c_match(struct device *dev, PORTABOOK_MATCH_CONST void *data)
+{
+    const struct portabook_i2c_watch *w = data;
+    struct acpi_device *adev;
+
+    if (w->adapter) {
+	/* the companion belongs to the controller the adapter sits on */
+	if (!i2c_verify_adapter(dev))
+	    return 0;
+	adev = ACPI_COMPANION(dev->parent);
+    }
+    else {
+	if (!i2c_verify_client(dev))
+	    return 0;
+	adev = ACPI_COMPANION(dev);
+    }
+    if (!adev || strcmp(acpi_device_hid(adev), w->hid))
+	return 0;
+    /* all controllers of a kind share the HID */
+    return !w->uid ||
+	(acpi_device_uid(adev) && !strcmp(acpi_device_uid(adev), w->uid));
+}
+
+/* run FOUND for DEV unless the watch already has a device */
+static int
+portabook_i2c_watch_claim(struct portabook_i2c_watch *w, struct device *dev)
+{
+    int claimed = 0;
+
+    mutex_lock(&w->lock);
+    if (!w->dev) {
+	w->dev = get_device(dev);
+	claimed = 1;
+    }
+    mutex_unlock(&w->lock);
+    return claimed;
+}
+
+static void
+portabook_i2c_watch_work(struct work_struct *work)
+{
+    struct portabook_i2c_watch *w =
+	container_of(work, struct portabook_i2c_watch, work);
+    struct device *failed = NULL;
+    int s;
+
+    mutex_lock(&w->lock);
+    if (w->dev && !w->bound) {
+	s = w->found(w->dev);
+	if (s) {
+	    dev_err(w->dev, "portabook_ext: setup failed (%d)\n", s);
+	    /* leave the watch open for the next matching device */
+	    failed = w->dev;
+	    w->dev = NULL;
+	}
+	else
+	    w->bound = 1;
+    }
+    mutex_unlock(&w->lock);
+    if (failed)
+	put_device(failed);
+}
+
+static int
+portabook_i2c_notify(struct notifier_block *nb, unsigned long action,
+		     void *data)
+{
+    struct portabook_i2c_watch *w =
+	container_of(nb, struct portabook_i2c_watch, nb);
+    struct device *dev = data;
+
+    switch (action) {
+    case BUS_NOTIFY_ADD_DEVICE:
+	if (portabook_i2c_match(dev, w) && portabook_i2c_watch_claim(w, dev))
+	    schedule_work(&w->work);
+	break;
+    case BUS_NOTIFY_DEL_DEVICE:
+	if (dev != w->dev)
+	    break;
+	cancel_work_sync(&w->work);
+	mutex_lock(&w->lock);
+	/* a failed FOUND may have released it meanwhile */
+	if (dev != w->dev) {
+	    mutex_unlock(&w->lock);
+	    break;
+	}
+	if (w->bound && w->lost)
+	    w->lost(dev);
+	w->bound = 0;
+	w->dev = NULL;
+	mutex_unlock(&w->lock);
+	put_device(dev);
+	break;
+    }
+    return NOTIFY_DONE;
+}
+
+int
+portabook_i2c_watch_start(struct portabook_i2c_watch *w)
+{
+    struct device *dev;
+    int s;
+
+    mutex_init(&w->lock);
+    INIT_WORK(&w->work, portabook_i2c_watch_work);
+    w->dev = NULL;
+    w->bound = 0;
+    w->nb.notifier_call = portabook_i2c_notify;
+
+    /* listen first so a device added during the search is not lost */
+    s = bus_register_notifier(&i2c_bus_type, &w->nb);
+    if (s)
+	return s;
+
+    dev = bus_find_device(&i2c_bus_type, NULL, w, portabook_i2c_match);
+    if (!dev) {
+	pr_info("portabook_ext: waiting for ACPI device %s%s%s\n", w->hid,
+		w->uid ? " _UID " : "", w->uid ? w->uid : "");
+	return 0;
+    }
+    s = 0;
+    if (portabook_i2c_watch_claim(w, dev)) {
+	mutex_lock(&w->lock);
+	s = w->found(dev);
+	w->bound = !s;
+	mutex_unlock(&w->lock);
+    }
+    put_device(dev);
+    if (s)
+	portabook_i2c_watch_stop(w);
+    return s;
+}
+
+void
+portabook_i2c_watch_stop(struct portabook_i2c_watch *w)
+{
+    bus_unregister_notifier(&i2c_bus_type, &w->nb);
+    cancel_work_sync(&w->work);
+    if (w->dev)
+	put_device(w->dev);
+    w->dev = NULL;
+    w->bound = 0;
+}
+
+/*
+ * Each i2c_transfer() takes its own runtime PM reference on the
+ * controller.  Holding one across a batch of transfers keeps the
+ * controller up for exactly that batch, and the autosuspend timer
+ * starts from its end.  Returns 0 if the reference is held; otherwise
+ * the transfers just go ahead as usual.
+ */
+int
+portabook_i2c_window_open(struct i2c_client *client)
+{
+    struct device *ctrl = client->adapter->dev.parent;
+    int s;
+
+    if (!ctrl)
+	return -ENODEV;
+    s = pm_runtime_get_sync(ctrl);
+    if (s < 0) {
+	pm_runtime_put_noidle(ctrl);
+	return s;
+    }
+    portabook_stats_inc(PORTABOOK_STAT_BUS_WINDOW);
+    /* 1 means it was already active */
+    if (s == 0)
+	portabook_stats_inc(PORTABOOK_STAT_BUS_WAKEUP);
+    return 0;
+}
+
+void
+portabook_i2c_window_close(struct i2c_client *client)
+{
+    struct device *ctrl = client->adapter->dev.parent;
+
+    pm_runtime_mark_last_busy(ctrl);
+    pm_runtime_put_autosuspend(ctrl);
+}
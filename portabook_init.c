@@ -19,47 +19,115 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/dmi.h>
+#include <linux/async.h>
+
+#include "portabook.h"
+
+#define CREATE_TRACE_POINTS
+#include "portabook_trace.h"
 
 MODULE_DESCRIPTION("Portabook extra Module");
 MODULE_AUTHOR("MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>");
 MODULE_LICENSE("GPL");
 
+static bool force = 0;
+module_param(force, bool, 0444);
+MODULE_PARM_DESC(force, "load on machines not recognized as Portabook");
+
+/* also lets udev load the module at boot through its dmi: alias */
+static const struct dmi_system_id portabook_dmi_table[] = {
+    {
+	.ident = "KING JIM Portabook XMC10",
+	.matches = {
+	    DMI_MATCH(DMI_SYS_VENDOR, "KING JIM"),
+	    DMI_MATCH(DMI_PRODUCT_NAME, "XMC10"),
+	},
+    },
+    {}
+};
+MODULE_DEVICE_TABLE(dmi, portabook_dmi_table);
+
+static ASYNC_DOMAIN_EXCLUSIVE(portabook_async_domain);
+
 #ifdef CONFIG_PORTABOOK_EXT_BACKLIGHT
-extern int portabook_backlight_init(void);
-extern void portabook_backlight_cleanup(void);
+static void
+portabook_backlight_init_async(void *data, async_cookie_t cookie)
+{
+    *(int *)data = portabook_backlight_init();
+}
 #endif
+
 #ifdef CONFIG_PORTABOOK_EXT_BATTERY
-extern int portabook_battery_init(void);
-extern void portabook_battery_cleanup(void);
+static void
+portabook_battery_init_async(void *data, async_cookie_t cookie)
+{
+    *(int *)data = portabook_battery_init();
+}
 #endif
 
+/*
+ * The backlight and battery share nothing but the bus, so set them up
+ * side by side and undo whichever succeeded if the other one failed.
+ */
 static int
 portabook_ext_init_module(void)
 {
+    int backlight_error = 0, battery_error = 0;
     int error = 0;
 
     printk("portabook_ext is loaded!\n");
-#ifdef CONFIG_PORTABOOK_EXT_BACKLIGHT
-    error = portabook_backlight_init();
+    error = portabook_emu_init();
     if (error)
 	return error;
+    if (!portabook_emu_enabled() && !force &&
+	!dmi_check_system(portabook_dmi_table)) {
+	printk("portabook_ext: not a Portabook, use force=1 to load anyway\n");
+	return -ENODEV;
+    }
+    error = portabook_stats_init();
+    if (error) {
+	portabook_emu_cleanup();
+	return error;
+    }
+#ifdef CONFIG_PORTABOOK_EXT_BACKLIGHT
+    async_schedule_domain(portabook_backlight_init_async, &backlight_error,
+			  &portabook_async_domain);
 #endif
 #ifdef CONFIG_PORTABOOK_EXT_BATTERY
-    error = portabook_battery_init();
-    if (error)
-	return error;
+    async_schedule_domain(portabook_battery_init_async, &battery_error,
+			  &portabook_async_domain);
+#endif
+    async_synchronize_full_domain(&portabook_async_domain);
+    if (!backlight_error && !battery_error) {
+	portabook_test_run();
+	return 0;
+    }
+
+#ifdef CONFIG_PORTABOOK_EXT_BATTERY
+    if (!battery_error)
+	portabook_battery_cleanup();
+#endif
+#ifdef CONFIG_PORTABOOK_EXT_BACKLIGHT
+    if (!backlight_error)
+	portabook_backlight_cleanup();
 #endif
-    return 0;
+    portabook_stats_cleanup();
+    portabook_emu_cleanup();
+    return backlight_error ? backlight_error : battery_error;
 }
 
 static void portabook_ext_cleanup_module(void)
 {
+    portabook_test_cleanup();
 #ifdef CONFIG_PORTABOOK_EXT_BATTERY
     portabook_battery_cleanup();
 #endif
 #ifdef CONFIG_PORTABOOK_EXT_BACKLIGHT
     portabook_backlight_cleanup();
 #endif
+    portabook_emu_cleanup();
+    portabook_stats_cleanup();
     printk("portabook_ext is unloaded!\n");
 }
 
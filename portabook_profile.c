@@ -0,0 +1,316 @@
+/*
+ * portabook_profile.c - Portabook extra module, energy profiling sampler
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * While enabled, a kernel thread reads the battery status, rate and
+ * voltage from the EC every interval_us, bypassing the property cache,
+ * and integrates charge and energy.  Controls and results are under
+ * /sys/kernel/debug/portabook_ext/profile/:
+ *
+ *   enable       write 1 to start (clears counters and samples), 0 to stop
+ *   interval_us  sampling interval, at least 1000
+ *   counters     samples, errors, dropped, elapsed_ns, charge_uah and
+ *                energy_uwh since start; read at both ends of a window
+ *                and subtract, like perf counters
+ *   samples      "t_ns current_ma voltage_mv state" lines, drained as
+ *                they are read
+ *
+ * Current, charge and energy are positive while discharging, so they
+ * measure what the workload consumed.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+
+#include "portabook.h"
+#include "portabook_compat.h"
+
+static unsigned int profile_buffer_samples = 8192;
+module_param(profile_buffer_samples, uint, 0444);
+MODULE_PARM_DESC(profile_buffer_samples,
+		 "profiling ring buffer size in samples (rounded to a power "
+		 "of two)");
+
+struct portabook_sample {
+    u64 t_ns;
+    s32 current_ma;
+    u16 voltage_mv;
+    u16 state;
+};
+
+static struct portabook_battery *profile_di;
+static struct dentry *profile_dir;
+static u32 profile_interval_us = 10000;
+/* each sample is a few EC transactions under the battery lock */
+#define PROFILE_MIN_INTERVAL_US	1000
+
+static DEFINE_MUTEX(profile_lock);	/* start/stop */
+static struct task_struct *profile_task;
+
+/* single producer (the thread) and single consumer (samples reader) */
+static DECLARE_KFIFO_PTR(profile_fifo, struct portabook_sample);
+static DEFINE_MUTEX(profile_read_lock);
+
+static DEFINE_SPINLOCK(profile_counter_lock);
+static struct {
+    u64 samples;
+    u64 errors;
+    u64 dropped;
+    u64 start_ns;
+    u64 last_ns;
+    s32 last_ma;
+    s32 last_mw;
+    s64 charge;			/* mA * us */
+    s64 energy;			/* mW * us */
+} profile;
+
+static void
+portabook_profile_account(u64 t, int state, int ma, int voltage)
+{
+    struct portabook_sample smp;
+    s32 mw;
+    s64 dt_us;
+
+    mw = ma * voltage / 1000;
+
+    smp.t_ns = t;
+    smp.current_ma = ma;
+    smp.voltage_mv = voltage;
+    smp.state = state;
+
+    spin_lock(&profile_counter_lock);
+    if (profile.samples) {
+	/* trapezoid between this sample and the previous one */
+	dt_us = div_u64(t - profile.last_ns, 1000);
+	profile.charge += div_s64((s64)(ma + profile.last_ma) * dt_us, 2);
+	profile.energy += div_s64((s64)(mw + profile.last_mw) * dt_us, 2);
+    }
+    profile.samples++;
+    profile.last_ns = t;
+    profile.last_ma = ma;
+    profile.last_mw = mw;
+    if (!kfifo_put(&profile_fifo, smp))
+	profile.dropped++;
+    spin_unlock(&profile_counter_lock);
+}
+
+static int
+portabook_profile_thread(void *data)
+{
+    int state, ma, voltage;
+    u64 t, spent_us;
+    u32 interval;
+    int s;
+
+    /* parked by the freezer across suspend, before the EC goes down */
+    set_freezable();
+    while (!kthread_freezable_should_stop(NULL)) {
+	t = ktime_get_ns();
+	s = portabook_battery_sample(profile_di, &state, &ma, &voltage);
+	if (s == 0)
+	    portabook_profile_account(t, state, ma, voltage);
+	else {
+	    spin_lock(&profile_counter_lock);
+	    profile.errors++;
+	    spin_unlock(&profile_counter_lock);
+	}
+
+	/* keep the period, not the gap, at interval_us */
+	interval = READ_ONCE(profile_interval_us);
+	spent_us = div_u64(ktime_get_ns() - t, 1000);
+	if (spent_us < interval)
+	    usleep_range(interval - spent_us, interval - spent_us + 50);
+	else
+	    cond_resched();
+    }
+    return 0;
+}
+
+static int
+portabook_profile_enable_get(void *data, u64 *val)
+{
+    *val = READ_ONCE(profile_task) != NULL;
+    return 0;
+}
+
+static int
+portabook_profile_enable_set(void *data, u64 val)
+{
+    struct task_struct *task;
+    int s = 0;
+
+    mutex_lock(&profile_lock);
+    if (val && !profile_task) {
+	mutex_lock(&profile_read_lock);
+	kfifo_reset(&profile_fifo);
+	mutex_unlock(&profile_read_lock);
+	spin_lock(&profile_counter_lock);
+	memset(&profile, 0, sizeof(profile));
+	profile.start_ns = ktime_get_ns();
+	spin_unlock(&profile_counter_lock);
+
+	task = kthread_run(portabook_profile_thread, NULL, "portabook_prof");
+	if (IS_ERR(task))
+	    s = PTR_ERR(task);
+	else
+	    profile_task = task;
+    }
+    else if (!val && profile_task) {
+	kthread_stop(profile_task);
+	profile_task = NULL;
+    }
+    mutex_unlock(&profile_lock);
+    return s;
+}
+DEFINE_SIMPLE_ATTRIBUTE(portabook_profile_enable_fops,
+			portabook_profile_enable_get,
+			portabook_profile_enable_set, "%llu\n");
+
+static int
+portabook_profile_interval_get(void *data, u64 *val)
+{
+    *val = READ_ONCE(profile_interval_us);
+    return 0;
+}
+
+static int
+portabook_profile_interval_set(void *data, u64 val)
+{
+    if (val < PROFILE_MIN_INTERVAL_US || val > U32_MAX)
+	return -EINVAL;
+    WRITE_ONCE(profile_interval_us, val);
+    return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(portabook_profile_interval_fops,
+			portabook_profile_interval_get,
+			portabook_profile_interval_set, "%llu\n");
+
+static int
+portabook_profile_counters_show(struct seq_file *m, void *v)
+{
+    typeof(profile) p;
+
+    spin_lock(&profile_counter_lock);
+    p = profile;
+    spin_unlock(&profile_counter_lock);
+
+    seq_printf(m, "samples %llu\n", p.samples);
+    seq_printf(m, "errors %llu\n", p.errors);
+    seq_printf(m, "dropped %llu\n", p.dropped);
+    seq_printf(m, "elapsed_ns %llu\n",
+	       p.samples ? p.last_ns - p.start_ns : 0);
+    /* 1 uAh = 3.6 mA*s = 3600000 mA*us, likewise for uWh */
+    seq_printf(m, "charge_uah %lld\n", div_s64(p.charge, 3600000));
+    seq_printf(m, "energy_uwh %lld\n", div_s64(p.energy, 3600000));
+    return 0;
+}
+
+static int
+portabook_profile_counters_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, portabook_profile_counters_show, NULL);
+}
+
+static const struct file_operations portabook_profile_counters_fops = {
+    .owner   = THIS_MODULE,
+    .open    = portabook_profile_counters_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t
+portabook_profile_samples_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+    struct portabook_sample smp;
+    char line[64];
+    ssize_t done = 0;
+    int len;
+
+    mutex_lock(&profile_read_lock);
+    while (kfifo_peek(&profile_fifo, &smp)) {
+	len = scnprintf(line, sizeof(line), "%llu %d %u %#x\n",
+			smp.t_ns, smp.current_ma, smp.voltage_mv, smp.state);
+	if (done + len > count)
+	    break;
+	if (copy_to_user(buf + done, line, len)) {
+	    if (!done)
+		done = -EFAULT;
+	    break;
+	}
+	kfifo_skip(&profile_fifo);
+	done += len;
+    }
+    mutex_unlock(&profile_read_lock);
+    return done;
+}
+
+static const struct file_operations portabook_profile_samples_fops = {
+    .owner  = THIS_MODULE,
+    .read   = portabook_profile_samples_read,
+    .llseek = no_llseek,
+};
+
+void
+portabook_profile_init(struct portabook_battery *di)
+{
+    if (!portabook_debugfs_dir())
+	return;
+    if (kfifo_alloc(&profile_fifo, profile_buffer_samples, GFP_KERNEL))
+	return;
+
+    profile_di = di;
+    profile_dir = debugfs_create_dir("profile", portabook_debugfs_dir());
+    if (IS_ERR_OR_NULL(profile_dir)) {
+	profile_dir = NULL;
+	kfifo_free(&profile_fifo);
+	return;
+    }
+    debugfs_create_file("enable", 0644, profile_dir, NULL,
+			&portabook_profile_enable_fops);
+    debugfs_create_file("interval_us", 0644, profile_dir, NULL,
+			&portabook_profile_interval_fops);
+    debugfs_create_file("counters", 0444, profile_dir, NULL,
+			&portabook_profile_counters_fops);
+    debugfs_create_file("samples", 0400, profile_dir, NULL,
+			&portabook_profile_samples_fops);
+}
+
+void
+portabook_profile_cleanup(void)
+{
+    if (!profile_dir)
+	return;
+    debugfs_remove_recursive(profile_dir);
+    profile_dir = NULL;
+    portabook_profile_enable_set(NULL, 0);
+    kfifo_free(&profile_fifo);
+    profile_di = NULL;
+}
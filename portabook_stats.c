@@ -0,0 +1,299 @@
+/*
+ * portabook_stats.c - Portabook extra module, debugfs statistics
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * Cumulative counters under /sys/kernel/debug/portabook_ext/:
+ *
+ *   stats  get_property calls, battery cache hits/misses, time spent
+ *          waiting for the battery refresh lock, EC failure handling
+ *          events, bus windows and controller wakeups, log2 latency
+ *          histograms and per-register error counts for EC and PMIC
+ *          transactions
+ *   reset  write anything to zero all counters
+ *
+ * Counters are per-CPU and only summed when stats is read.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/power_supply.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+
+#include "portabook.h"
+
+#define STATS_MAX_PROP		64
+#define STATS_HIST_BUCKETS	24	/* bucket b: [2^(b-1), 2^b) us */
+#define STATS_EC_REGS		0x200
+#define STATS_PMIC_REGS		0x100
+
+struct portabook_stats {
+    u64 prop_calls[PORTABOOK_SUPPLY_NUM][STATS_MAX_PROP];
+    u64 counters[PORTABOOK_STAT_NUM];
+    u64 cache_hit;
+    u64 cache_miss;
+    u64 lock_wait_ns;
+    u64 lock_acquires;
+    u64 ec_hist[STATS_HIST_BUCKETS];
+    u64 pmic_hist[STATS_HIST_BUCKETS];
+    u32 ec_errors[STATS_EC_REGS];
+    u32 pmic_errors[STATS_PMIC_REGS];
+};
+
+static struct portabook_stats __percpu *stats;
+static struct dentry *portabook_debugfs;
+
+static const char * const supply_names[PORTABOOK_SUPPLY_NUM] = {
+    [PORTABOOK_SUPPLY_BATTERY]	= "battery",
+    [PORTABOOK_SUPPLY_AC]	= "ac",
+};
+
+static const char * const counter_names[PORTABOOK_STAT_NUM] = {
+    [PORTABOOK_STAT_EC_RETRY]		= "ec_retry",
+    [PORTABOOK_STAT_REFRESH_FAILED]	= "refresh_failed",
+    [PORTABOOK_STAT_BACKOFF_SKIPPED]	= "backoff_skipped",
+    [PORTABOOK_STAT_STALE_SERVED]	= "stale_served",
+    [PORTABOOK_STAT_REVALIDATE]		= "revalidate",
+    [PORTABOOK_STAT_EVENT]		= "event",
+    [PORTABOOK_STAT_BUS_WINDOW]		= "bus_window",
+    [PORTABOOK_STAT_BUS_WAKEUP]		= "bus_wakeup",
+    [PORTABOOK_STAT_BATCH_EARLY]	= "batch_early",
+};
+
+static const struct {
+    enum power_supply_property psp;
+    const char *name;
+} prop_names[] = {
+    { POWER_SUPPLY_PROP_STATUS,			"status" },
+    { POWER_SUPPLY_PROP_PRESENT,		"present" },
+    { POWER_SUPPLY_PROP_ONLINE,			"online" },
+    { POWER_SUPPLY_PROP_VOLTAGE_MIN_DESIGN,	"voltage_min_design" },
+    { POWER_SUPPLY_PROP_VOLTAGE_NOW,		"voltage_now" },
+    { POWER_SUPPLY_PROP_CURRENT_NOW,		"current_now" },
+    { POWER_SUPPLY_PROP_CURRENT_AVG,		"current_avg" },
+    { POWER_SUPPLY_PROP_POWER_NOW,		"power_now" },
+    { POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,	"charge_full_design" },
+    { POWER_SUPPLY_PROP_CHARGE_FULL,		"charge_full" },
+    { POWER_SUPPLY_PROP_CHARGE_NOW,		"charge_now" },
+    { POWER_SUPPLY_PROP_CAPACITY,		"capacity" },
+    { POWER_SUPPLY_PROP_CAPACITY_LEVEL,		"capacity_level" },
+    { POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG,	"time_to_empty_avg" },
+    { POWER_SUPPLY_PROP_TIME_TO_FULL_AVG,	"time_to_full_avg" },
+};
+
+static int
+latency_bucket(u64 ns)
+{
+    int b = fls64(div_u64(ns, 1000));
+    return min(b, STATS_HIST_BUCKETS - 1);
+}
+
+void
+portabook_stats_inc(enum portabook_stat_counter counter)
+{
+    if (stats)
+	this_cpu_inc(stats->counters[counter]);
+}
+
+void
+portabook_stats_prop(enum portabook_supply supply, int psp)
+{
+    if (stats && psp >= 0 && psp < STATS_MAX_PROP)
+	this_cpu_inc(stats->prop_calls[supply][psp]);
+}
+
+void
+portabook_stats_cache(bool hit)
+{
+    if (!stats)
+	return;
+    if (hit)
+	this_cpu_inc(stats->cache_hit);
+    else
+	this_cpu_inc(stats->cache_miss);
+}
+
+void
+portabook_stats_lock_wait(u64 ns)
+{
+    if (!stats)
+	return;
+    this_cpu_add(stats->lock_wait_ns, ns);
+    this_cpu_inc(stats->lock_acquires);
+}
+
+void
+portabook_stats_ec(int reg, int ret, u64 ns)
+{
+    if (!stats)
+	return;
+    this_cpu_inc(stats->ec_hist[latency_bucket(ns)]);
+    if (ret < 0)
+	this_cpu_inc(stats->ec_errors[reg & (STATS_EC_REGS - 1)]);
+}
+
+void
+portabook_stats_pmic(int reg, int ret, u64 ns)
+{
+    if (!stats)
+	return;
+    this_cpu_inc(stats->pmic_hist[latency_bucket(ns)]);
+    if (ret < 0)
+	this_cpu_inc(stats->pmic_errors[reg & (STATS_PMIC_REGS - 1)]);
+}
+
+#define STATS_SUM(field)					\
+    ({								\
+	u64 __sum = 0;						\
+	int __cpu;						\
+	for_each_possible_cpu(__cpu)				\
+	    __sum += per_cpu_ptr(stats, __cpu)->field;		\
+	__sum;							\
+    })
+
+static void
+stats_show_hist(struct seq_file *m, const char *name, u64 *hist)
+{
+    int b;
+
+    seq_printf(m, "%s_latency_us:\n", name);
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+	if (!hist[b])
+	    continue;
+	if (b == 0)
+	    seq_printf(m, "  [%8u, %8u) %llu\n", 0, 1, hist[b]);
+	else if (b == STATS_HIST_BUCKETS - 1)
+	    seq_printf(m, "  [%8u,      inf) %llu\n", 1U << (b - 1), hist[b]);
+	else
+	    seq_printf(m, "  [%8u, %8u) %llu\n",
+		       1U << (b - 1), 1U << b, hist[b]);
+    }
+}
+
+static int
+stats_show(struct seq_file *m, void *v)
+{
+    u64 hist[STATS_HIST_BUCKETS];
+    u64 n;
+    int i, j;
+
+    for (i = 0; i < PORTABOOK_SUPPLY_NUM; i++) {
+	seq_printf(m, "%s_get_property:\n", supply_names[i]);
+	for (j = 0; j < ARRAY_SIZE(prop_names); j++) {
+	    if (prop_names[j].psp >= STATS_MAX_PROP)
+		continue;
+	    n = STATS_SUM(prop_calls[i][prop_names[j].psp]);
+	    if (n)
+		seq_printf(m, "  %s %llu\n", prop_names[j].name, n);
+	}
+    }
+
+    seq_printf(m, "cache_hit %llu\n", STATS_SUM(cache_hit));
+    seq_printf(m, "cache_miss %llu\n", STATS_SUM(cache_miss));
+    seq_printf(m, "lock_wait_ns %llu\n", STATS_SUM(lock_wait_ns));
+    seq_printf(m, "lock_acquires %llu\n", STATS_SUM(lock_acquires));
+    for (i = 0; i < PORTABOOK_STAT_NUM; i++)
+	seq_printf(m, "%s %llu\n", counter_names[i], STATS_SUM(counters[i]));
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+	hist[i] = STATS_SUM(ec_hist[i]);
+    stats_show_hist(m, "ec", hist);
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+	hist[i] = STATS_SUM(pmic_hist[i]);
+    stats_show_hist(m, "pmic", hist);
+
+    seq_puts(m, "ec_errors:\n");
+    for (i = 0; i < STATS_EC_REGS; i++) {
+	n = STATS_SUM(ec_errors[i]);
+	if (n)
+	    seq_printf(m, "  %#x %llu\n", i, n);
+    }
+    seq_puts(m, "pmic_errors:\n");
+    for (i = 0; i < STATS_PMIC_REGS; i++) {
+	n = STATS_SUM(pmic_errors[i]);
+	if (n)
+	    seq_printf(m, "  %#x %llu\n", i, n);
+    }
+    return 0;
+}
+
+static int
+stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_show, NULL);
+}
+
+static const struct file_operations stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t
+reset_write(struct file *file, const char __user *buf, size_t count,
+	    loff_t *ppos)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+	memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct portabook_stats));
+    return count;
+}
+
+static const struct file_operations reset_fops = {
+    .owner = THIS_MODULE,
+    .write = reset_write,
+};
+
+struct dentry *
+portabook_debugfs_dir(void)
+{
+    return portabook_debugfs;
+}
+
+int
+portabook_stats_init(void)
+{
+    stats = alloc_percpu(struct portabook_stats);
+    if (!stats)
+	return -ENOMEM;
+
+    /* statistics are optional: carry on without debugfs */
+    portabook_debugfs = debugfs_create_dir("portabook_ext", NULL);
+    if (IS_ERR_OR_NULL(portabook_debugfs)) {
+	portabook_debugfs = NULL;
+	return 0;
+    }
+    debugfs_create_file("stats", 0444, portabook_debugfs, NULL, &stats_fops);
+    debugfs_create_file("reset", 0200, portabook_debugfs, NULL, &reset_fops);
+    return 0;
+}
+
+void
+portabook_stats_cleanup(void)
+{
+    debugfs_remove_recursive(portabook_debugfs);
+    portabook_debugfs = NULL;
+    free_percpu(stats);
+    stats = NULL;
+}
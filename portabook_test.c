@@ -0,0 +1,408 @@
+/*
+ * portabook_test.c - Portabook extra module, KUnit tests
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * Unit tests for the battery and backlight decision logic, built with
+ * CONFIG_PORTABOOK_EXT_KUNIT_TEST = y in Makefile against a kernel
+ * with CONFIG_KUNIT (5.13 or later).  The suites run when the module
+ * is loaded; results appear in dmesg and under
+ * /sys/kernel/debug/kunit/.  The registers come from the emulator's
+ * EC model, so no Portabook is needed.
+ *
+ * The *_bench cases print ns/op for power_supply_get_property() on
+ * the registered supplies, the path sysfs readers take.  Load with
+ * emulate=1 so that they read the emulator.
+ */
+
+#if !defined(CONFIG_PORTABOOK_EXT_BATTERY) || \
+    !defined(CONFIG_PORTABOOK_EXT_BACKLIGHT) || \
+    !defined(CONFIG_PORTABOOK_EXT_EMULATOR)
+#error "the KUnit tests need the battery, backlight and emulator features"
+#endif
+
+#include <linux/version.h>
+#include <linux/kconfig.h>
+
+/* kunit_skip() and the module runner appeared in 5.13 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,13,0) || !IS_ENABLED(CONFIG_KUNIT)
+#error "the KUnit tests need a 5.13 or later kernel with CONFIG_KUNIT"
+#endif
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/fb.h>
+#include <linux/backlight.h>
+#include <linux/power_supply.h>
+
+#include "portabook.h"
+#include "portabook_battery.h"
+
+#define BENCH_LOOPS	100000
+
+/* a battery neither charging nor discharging */
+static void
+fill_idle(struct portabook_battery_info *info, int full, int capacity)
+{
+    memset(info, 0, sizeof(*info));
+    info->full_charge_capacity = full;
+    info->capacity_now = capacity;
+    info->voltage_now = DESIGN_VOLTAGE;
+}
+
+/*
+ * Above DESIGN_CAPACITY the design-value fallback of is_charged() does
+ * not apply, so only battery_fullcharged_percentage decides.
+ */
+static void
+portabook_test_fullcharged_edge(struct kunit *test)
+{
+    struct portabook_battery_info info;
+    unsigned int pct = battery_fullcharged_percentage;
+    int full = 10000;
+    int edge = full * pct / 100;
+
+    if (edge - 1 <= DESIGN_CAPACITY)
+	kunit_skip(test, "battery_fullcharged_percentage %u too low", pct);
+
+    fill_idle(&info, full, edge);
+    KUNIT_EXPECT_EQ(test, portabook_battery_is_charged(&info), 1);
+    KUNIT_EXPECT_EQ(test, portabook_battery_status(&info),
+		    POWER_SUPPLY_STATUS_FULL);
+    KUNIT_EXPECT_EQ(test, portabook_battery_capacity_level(&info),
+		    POWER_SUPPLY_CAPACITY_LEVEL_FULL);
+
+    fill_idle(&info, full, edge - 1);
+    KUNIT_EXPECT_EQ(test, portabook_battery_is_charged(&info), 0);
+    KUNIT_EXPECT_EQ(test, portabook_battery_status(&info),
+		    POWER_SUPPLY_STATUS_UNKNOWN);
+    KUNIT_EXPECT_EQ(test, portabook_battery_capacity_level(&info),
+		    POWER_SUPPLY_CAPACITY_LEVEL_NORMAL);
+}
+
+/* discharge below battery_ignore_discharge_rate counts as idle */
+static void
+portabook_test_discharge_rate_edge(struct kunit *test)
+{
+    struct portabook_battery_info info;
+    int rate = battery_ignore_discharge_rate;
+
+    if (rate == 0)
+	kunit_skip(test, "battery_ignore_discharge_rate is 0");
+
+    fill_idle(&info, 4000, 3990);
+    info.state = ACPI_BATTERY_STATE_DISCHARGING;
+    info.rate_now = rate;
+    KUNIT_EXPECT_EQ(test, portabook_battery_is_charged(&info), 0);
+    KUNIT_EXPECT_EQ(test, portabook_battery_status(&info),
+		    POWER_SUPPLY_STATUS_DISCHARGING);
+
+    info.rate_now = rate - 1;
+    KUNIT_EXPECT_EQ(test, portabook_battery_is_charged(&info), 1);
+    KUNIT_EXPECT_EQ(test, portabook_battery_status(&info),
+		    POWER_SUPPLY_STATUS_FULL);
+}
+
+static void
+portabook_test_charging(struct kunit *test)
+{
+    struct portabook_battery_info info;
+
+    fill_idle(&info, 4000, 4000);
+    info.state = ACPI_BATTERY_STATE_CHARGING;
+    KUNIT_EXPECT_EQ(test, portabook_battery_is_charged(&info), 0);
+    KUNIT_EXPECT_EQ(test, portabook_battery_status(&info),
+		    POWER_SUPPLY_STATUS_CHARGING);
+
+    /* no charge reported is never full */
+    fill_idle(&info, 4000, 0);
+    KUNIT_EXPECT_EQ(test, portabook_battery_is_charged(&info), 0);
+}
+
+static void
+portabook_test_capacity_level(struct kunit *test)
+{
+    struct portabook_battery_info info;
+
+    fill_idle(&info, 4000, DESIGN_WARN_CAPACITY);
+    KUNIT_EXPECT_EQ(test, portabook_battery_capacity_level(&info),
+		    POWER_SUPPLY_CAPACITY_LEVEL_LOW);
+    fill_idle(&info, 4000, DESIGN_WARN_CAPACITY + 1);
+    KUNIT_EXPECT_NE(test, portabook_battery_capacity_level(&info),
+		    POWER_SUPPLY_CAPACITY_LEVEL_LOW);
+
+    /* the EC's critical flag wins over any capacity */
+    fill_idle(&info, 4000, 4000);
+    info.state = ACPI_BATTERY_STATE_CRITICAL;
+    KUNIT_EXPECT_EQ(test, portabook_battery_capacity_level(&info),
+		    POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL);
+}
+
+/* read REG..REG+LEN-1 from the emulated EC */
+static void
+emu_read(struct kunit *test, int reg, u8 *buf, int len)
+{
+    KUNIT_ASSERT_GT(test, portabook_emu_ec_ops.read(NULL, reg, buf, len), 0);
+}
+
+/* H/L pairs are big endian; values above 255 catch swapped bytes */
+static void
+portabook_test_decode(struct kunit *test)
+{
+    static const struct {
+	int field;
+	int reg;
+	int value;
+    } regs[] = {
+	{ BATTINFO_LAST_CAP,	 BATT_INFO_LAST_CAP_H,	    0x1234 },
+	{ BATTINFO_STATUS,	 BATT_INFO_STATUS_H,	    0x0102 },
+	{ BATTINFO_PRESENT_RATE, BATT_INFO_PRESENT_RATE_H,  0x03e8 },
+	{ BATTINFO_REMAIN_CAP,	 BATT_INFO_REMAIN_CAP_H,    0x0e10 },
+	{ BATTINFO_PRESENT_VOLT, BATT_INFO_PRESENT_VOLT_H,  0x0f3c },
+	{ BATTINFO_AC_ADAPTER,	 BATT_INFO_AC_ADAPTER,	    0x01 },
+    };
+    struct portabook_battery_info info;
+    int saved[ARRAY_SIZE(regs)];
+    unsigned long now = jiffies;
+    u8 buf[8];
+    int i, *p;
+
+    for (i = 0; i < ARRAY_SIZE(regs); i++) {
+	p = portabook_emu_ec_value(regs[i].reg);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, p);
+	saved[i] = *p;
+	*p = regs[i].value;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.expired = BATTINFO_ALL;
+
+    /* the status..voltage run, as a refresh reads it */
+    emu_read(test, BATT_INFO_STATUS_H, buf, 8);
+    for (i = BATTINFO_STATUS; i <= BATTINFO_PRESENT_VOLT; i++)
+	portabook_battinfo_decode(&info, i, BATT_INFO_STATUS_H, buf, now);
+    emu_read(test, BATT_INFO_LAST_CAP_H, buf, 2);
+    portabook_battinfo_decode(&info, BATTINFO_LAST_CAP,
+			      BATT_INFO_LAST_CAP_H, buf, now);
+    emu_read(test, BATT_INFO_AC_ADAPTER, buf, 1);
+    portabook_battinfo_decode(&info, BATTINFO_AC_ADAPTER,
+			      BATT_INFO_AC_ADAPTER, buf, now);
+
+    for (i = 0; i < ARRAY_SIZE(regs); i++)
+	*portabook_emu_ec_value(regs[i].reg) = saved[i];
+
+    KUNIT_EXPECT_EQ(test, info.full_charge_capacity, 0x1234);
+    KUNIT_EXPECT_EQ(test, info.state, 0x0102);
+    KUNIT_EXPECT_EQ(test, info.rate_now, 0x03e8);
+    KUNIT_EXPECT_EQ(test, info.capacity_now, 0x0e10);
+    KUNIT_EXPECT_EQ(test, info.voltage_now, 0x0f3c);
+    KUNIT_EXPECT_EQ(test, info.ac_adapter, 0x01);
+    KUNIT_EXPECT_EQ(test, info.expired, 0U);
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++)
+	KUNIT_EXPECT_EQ(test, info.update_time[i], now);
+}
+
+static void
+portabook_test_stale(struct kunit *test)
+{
+    struct portabook_battery_info info;
+    unsigned long now = jiffies;
+    unsigned long fast = msecs_to_jiffies(battery_info_cache_time);
+    int i;
+
+    memset(&info, 0, sizeof(info));
+    /* never read */
+    KUNIT_EXPECT_EQ(test, portabook_battery_stale(&info, BATTINFO_ALL),
+		    (unsigned int)BATTINFO_ALL);
+
+    for (i = 0; i < BATTINFO_NUM_FIELDS; i++)
+	info.update_time[i] = now;
+    KUNIT_EXPECT_EQ(test, portabook_battery_stale(&info, BATTINFO_ALL), 0U);
+
+    /* invalidated, e.g. after resume or an event */
+    info.expired = BATTINFO_F(AC_ADAPTER);
+    KUNIT_EXPECT_EQ(test, portabook_battery_stale(&info, BATTINFO_ALL),
+		    (unsigned int)BATTINFO_F(AC_ADAPTER));
+    KUNIT_EXPECT_EQ(test,
+		    portabook_battery_stale(&info, BATTINFO_F(STATUS)), 0U);
+    info.expired = 0;
+
+    /* a fast field expires at its TTL, not before; the margin keeps
+       a jiffies tick during the test from mattering */
+    info.update_time[BATTINFO_PRESENT_RATE] = now - fast + HZ / 10;
+    KUNIT_EXPECT_EQ(test, portabook_battery_stale(&info, BATTINFO_ALL), 0U);
+    info.update_time[BATTINFO_PRESENT_RATE] = now - fast;
+    KUNIT_EXPECT_EQ(test, portabook_battery_stale(&info, BATTINFO_ALL),
+		    (unsigned int)BATTINFO_F(PRESENT_RATE));
+    /* only fields in the mask are reported */
+    KUNIT_EXPECT_EQ(test,
+		    portabook_battery_stale(&info, BATTINFO_F(PRESENT_VOLT)),
+		    0U);
+
+    /* the full capacity outlives the fast TTL */
+    if (battery_full_cache_time > battery_info_cache_time) {
+	for (i = 0; i < BATTINFO_NUM_FIELDS; i++)
+	    info.update_time[i] = now - fast;
+	KUNIT_EXPECT_FALSE(test,
+			   portabook_battery_stale(&info, BATTINFO_ALL) &
+			   BATTINFO_F(LAST_CAP));
+    }
+}
+
+/*
+ * Time PSP on supply NAME through the power supply core, which calls
+ * our get_property: a seqlock snapshot, and the EC only when the
+ * cache has expired.  The first read fills the cache.
+ */
+static void
+bench_property(struct kunit *test, const char *name,
+	       enum power_supply_property psp)
+{
+    struct power_supply *psy;
+    union power_supply_propval val;
+    long long acc = 0;
+    u64 t;
+    int i, s;
+
+    psy = power_supply_get_by_name(name);
+    if (!psy)
+	kunit_skip(test, "no %s supply, load with emulate=1", name);
+
+    s = power_supply_get_property(psy, psp, &val);
+    if (s) {
+	power_supply_put(psy);
+	KUNIT_FAIL(test, "%s property %d: %d", name, psp, s);
+	return;
+    }
+    t = ktime_get_ns();
+    for (i = 0; i < BENCH_LOOPS; i++) {
+	power_supply_get_property(psy, psp, &val);
+	acc += val.intval;
+    }
+    t = ktime_get_ns() - t;
+    power_supply_put(psy);
+    kunit_info(test, "%s property %d: %llu ns/op (%lld)\n",
+	       name, psp, div_u64(t, BENCH_LOOPS), acc);
+}
+
+static void
+portabook_test_capacity_bench(struct kunit *test)
+{
+    bench_property(test, "portabook_batt", POWER_SUPPLY_PROP_CAPACITY);
+}
+
+static void
+portabook_test_status_bench(struct kunit *test)
+{
+    bench_property(test, "portabook_batt", POWER_SUPPLY_PROP_STATUS);
+}
+
+static void
+portabook_test_online_bench(struct kunit *test)
+{
+    bench_property(test, "portabook_ac", POWER_SUPPLY_PROP_ONLINE);
+}
+
+static struct kunit_case portabook_battery_test_cases[] = {
+    KUNIT_CASE(portabook_test_fullcharged_edge),
+    KUNIT_CASE(portabook_test_discharge_rate_edge),
+    KUNIT_CASE(portabook_test_charging),
+    KUNIT_CASE(portabook_test_capacity_level),
+    KUNIT_CASE(portabook_test_decode),
+    KUNIT_CASE(portabook_test_stale),
+    KUNIT_CASE(portabook_test_capacity_bench),
+    KUNIT_CASE(portabook_test_status_bench),
+    KUNIT_CASE(portabook_test_online_bench),
+    {}
+};
+
+static struct kunit_suite portabook_battery_test_suite = {
+    .name = "portabook_battery",
+    .test_cases = portabook_battery_test_cases,
+};
+
+static void
+portabook_test_backlight_action(struct kunit *test)
+{
+    /* power down, suspend and fb blank all switch the panel off */
+    KUNIT_EXPECT_EQ(test,
+		    portabook_backlight_action(FB_BLANK_POWERDOWN, 0, 0, 0),
+		    BACKLIGHT_ACTION_DISABLE);
+    KUNIT_EXPECT_EQ(test,
+		    portabook_backlight_action(FB_BLANK_UNBLANK,
+					       BL_CORE_SUSPENDED, 0, 1),
+		    BACKLIGHT_ACTION_DISABLE);
+    KUNIT_EXPECT_EQ(test,
+		    portabook_backlight_action(FB_BLANK_UNBLANK,
+					       BL_CORE_FBBLANK, 1, 0),
+		    BACKLIGHT_ACTION_DISABLE);
+
+    /* an off panel is powered up, even with a flush pending */
+    KUNIT_EXPECT_EQ(test,
+		    portabook_backlight_action(FB_BLANK_UNBLANK, 0, 1, 1),
+		    BACKLIGHT_ACTION_ENABLE);
+
+    KUNIT_EXPECT_EQ(test,
+		    portabook_backlight_action(FB_BLANK_UNBLANK, 0, 0, 1),
+		    BACKLIGHT_ACTION_DEFER);
+    KUNIT_EXPECT_EQ(test,
+		    portabook_backlight_action(FB_BLANK_UNBLANK, 0, 0, 0),
+		    BACKLIGHT_ACTION_SET);
+}
+
+static struct kunit_case portabook_backlight_test_cases[] = {
+    KUNIT_CASE(portabook_test_backlight_action),
+    {}
+};
+
+static struct kunit_suite portabook_backlight_test_suite = {
+    .name = "portabook_backlight",
+    .test_cases = portabook_backlight_test_cases,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+/* run by KUnit once the module is live */
+kunit_test_suites(&portabook_battery_test_suite,
+		  &portabook_backlight_test_suite);
+#else
+/*
+ * Before 6.0 kunit_test_suites() in a module defines module_init and
+ * module_exit of its own, which portabook_init.c already has, so the
+ * suites are run from there once the supplies exist.
+ */
+static struct kunit_suite *portabook_test_suites[] = {
+    &portabook_battery_test_suite,
+    &portabook_backlight_test_suite,
+    NULL,
+};
+
+void
+portabook_test_run(void)
+{
+    __kunit_test_suites_init(portabook_test_suites);
+}
+
+void
+portabook_test_cleanup(void)
+{
+    __kunit_test_suites_exit(portabook_test_suites);
+}
+#endif
@@ -0,0 +1,148 @@
+/*
+ * portabook_trace.h - Portabook extra module, trace events
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM portabook
+
+#if !defined(_PORTABOOK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PORTABOOK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define PORTABOOK_TRACE_MAX_RUN	8
+
+/* one backend call reading LEN consecutive EC registers */
+TRACE_EVENT(portabook_ec_read,
+    TP_PROTO(int reg, int len, const u8 *buf, int ret, u64 duration_ns),
+    TP_ARGS(reg, len, buf, ret, duration_ns),
+
+    TP_STRUCT__entry(
+	__field(int, reg)
+	__field(int, len)
+	__array(u8, buf, PORTABOOK_TRACE_MAX_RUN)
+	__field(int, ret)
+	__field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+	__entry->reg = reg;
+	__entry->len = min(len, PORTABOOK_TRACE_MAX_RUN);
+	memset(__entry->buf, 0, PORTABOOK_TRACE_MAX_RUN);
+	if (ret >= 0)
+	    memcpy(__entry->buf, buf, __entry->len);
+	__entry->ret = ret;
+	__entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("reg=%#x len=%d val=%s ret=%d duration=%lluns",
+	      __entry->reg, __entry->len,
+	      __print_hex(__entry->buf, __entry->len),
+	      __entry->ret, __entry->duration_ns)
+);
+
+DECLARE_EVENT_CLASS(portabook_pmic_reg,
+    TP_PROTO(int reg, u8 val, int ret, u64 duration_ns),
+    TP_ARGS(reg, val, ret, duration_ns),
+
+    TP_STRUCT__entry(
+	__field(int, reg)
+	__field(u8, val)
+	__field(int, ret)
+	__field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+	__entry->reg = reg;
+	__entry->val = val;
+	__entry->ret = ret;
+	__entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("reg=%#x val=%#x ret=%d duration=%lluns",
+	      __entry->reg, __entry->val, __entry->ret,
+	      __entry->duration_ns)
+);
+
+DEFINE_EVENT(portabook_pmic_reg, portabook_pmic_read,
+    TP_PROTO(int reg, u8 val, int ret, u64 duration_ns),
+    TP_ARGS(reg, val, ret, duration_ns)
+);
+
+/* registers of one write sequence share its ret and duration */
+DEFINE_EVENT(portabook_pmic_reg, portabook_pmic_write,
+    TP_PROTO(int reg, u8 val, int ret, u64 duration_ns),
+    TP_ARGS(reg, val, ret, duration_ns)
+);
+
+/* FETCHED is 0 when the request was served from the cache */
+TRACE_EVENT(portabook_battery_refresh,
+    TP_PROTO(unsigned int mask, unsigned int fetched, int ret,
+	     u64 duration_ns),
+    TP_ARGS(mask, fetched, ret, duration_ns),
+
+    TP_STRUCT__entry(
+	__field(unsigned int, mask)
+	__field(unsigned int, fetched)
+	__field(int, ret)
+	__field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+	__entry->mask = mask;
+	__entry->fetched = fetched;
+	__entry->ret = ret;
+	__entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("%s mask=%#x fetched=%#x ret=%d duration=%lluns",
+	      __entry->fetched ? "miss" : "hit",
+	      __entry->mask, __entry->fetched, __entry->ret,
+	      __entry->duration_ns)
+);
+
+TRACE_EVENT(portabook_backlight_state,
+    TP_PROTO(int power, unsigned int state, int brightness, int disabled),
+    TP_ARGS(power, state, brightness, disabled),
+
+    TP_STRUCT__entry(
+	__field(int, power)
+	__field(unsigned int, state)
+	__field(int, brightness)
+	__field(int, disabled)
+    ),
+
+    TP_fast_assign(
+	__entry->power = power;
+	__entry->state = state;
+	__entry->brightness = brightness;
+	__entry->disabled = disabled;
+    ),
+
+    TP_printk("power=%d state=%#x brightness=%d %s",
+	      __entry->power, __entry->state, __entry->brightness,
+	      __entry->disabled ? "disabled" : "enabled")
+);
+
+#endif /* _PORTABOOK_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE portabook_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,99 @@
+/*
+ * portabook_uapi.h - Portabook extra module, userspace interface
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * Layout shared with userspace; include from programs as is.
+ *
+ * Each read() of /dev/portabook returns one struct portabook_snapshot
+ * taken from a single refresh.  The first read returns at once; later
+ * ones block until seq moves on, i.e. a refresh changed a value, and
+ * poll() reports POLLIN at that point.  Without battery_poll_interval
+ * refreshes only happen when somebody reads, so set it for change
+ * notification.
+ *
+ * Fields use the units of the power_supply class.  New fields are
+ * only ever appended; check version and size.
+ */
+
+#ifndef __PORTABOOK_UAPI_H__
+#define __PORTABOOK_UAPI_H__
+
+#include <linux/types.h>
+
+#define PORTABOOK_SNAPSHOT_VERSION	1
+
+/* flags */
+#define PORTABOOK_SNAPSHOT_STALE	(1 << 0)	/* EC failing, old data */
+
+struct portabook_snapshot {
+    __u32 version;		/* PORTABOOK_SNAPSHOT_VERSION */
+    __u32 size;			/* sizeof(struct portabook_snapshot) */
+    __u64 seq;			/* bumped whenever a value changes */
+    __u64 timestamp_ns;		/* CLOCK_MONOTONIC of the refresh */
+    __u32 flags;
+    __s32 last_error;		/* errno of the last refresh, 0 if fine */
+
+    __s32 ac_online;
+    __s32 status;		/* POWER_SUPPLY_STATUS_* */
+    __s32 capacity;		/* percent */
+    __s32 capacity_level;	/* POWER_SUPPLY_CAPACITY_LEVEL_* */
+    __s32 voltage_now;		/* uV */
+    __s32 current_now;		/* uA */
+    __s32 current_avg;		/* uA */
+    __s32 power_now;		/* uW */
+    __s32 charge_now;		/* uAh */
+    __s32 charge_full;		/* uAh */
+    __s32 charge_full_design;	/* uAh */
+    __s32 time_to_empty_avg;	/* s, -1 if not discharging */
+    __s32 time_to_full_avg;	/* s, -1 if not charging */
+    __u32 ec_state;		/* raw EC battery state register */
+};
+
+/*
+ * The same record in a page that can be mapped read-only from
+ * /dev/portabook (offset 0, one page).  The kernel makes seq odd
+ * while it rewrites snap; use portabook_shared_read() to copy it out.
+ */
+struct portabook_shared {
+    __u32 seq;
+    __u32 reserved;
+    struct portabook_snapshot snap;
+};
+
+#ifndef __KERNEL__
+#include <string.h>
+
+static inline void
+portabook_shared_read(const struct portabook_shared *sh,
+		      struct portabook_snapshot *snap)
+{
+    __u32 seq;
+
+    for (;;) {
+	seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+	    continue;
+	memcpy(snap, (const void *)&sh->snap, sizeof(*snap));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&sh->seq, __ATOMIC_RELAXED) == seq)
+	    return;
+    }
+}
+#endif
+
+#endif /* __PORTABOOK_UAPI_H__ */
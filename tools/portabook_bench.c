@@ -0,0 +1,263 @@
+/*
+ * portabook_bench.c - sysfs load benchmark for portabook_ext
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * Runs N threads reading battery/AC properties and M threads writing
+ * the backlight brightness, then reports throughput and p50/p99
+ * latency for each kind.  Works against real hardware or against the
+ * module loaded with emulate=1.  With -p the readers hammer that one
+ * battery property instead of rotating, which isolates the cost of a
+ * single get_property path (e.g. -p capacity for the cached path,
+ * -p voltage_now with a short TTL for the EC path).
+ *
+ *   make bench
+ *   sudo tools/portabook_bench -r 8 -w 1 -t 10
+ *   sudo tools/portabook_bench -r 1 -w 0 -p capacity
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *battery_props[] = {
+    "status", "capacity", "capacity_level", "voltage_now",
+    "current_now", "charge_now", "charge_full",
+};
+#define NUM_BATTERY_PROPS (sizeof(battery_props) / sizeof(battery_props[0]))
+
+static const char *batt_dir = "/sys/class/power_supply/portabook_batt";
+static const char *ac_dir = "/sys/class/power_supply/portabook_ac";
+static const char *bl_dir = "/sys/class/backlight/portabook_bl";
+static const char *single_prop;
+static unsigned int write_interval_us;
+static volatile int stop;
+
+struct samples {
+    unsigned long long *ns;
+    size_t count;
+    size_t size;
+    unsigned long errors;
+};
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+add_sample(struct samples *s, unsigned long long ns)
+{
+    if (s->count == s->size) {
+	s->size = s->size ? s->size * 2 : 4096;
+	s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+	if (!s->ns) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    s->ns[s->count++] = ns;
+}
+
+static int
+read_file(const char *path)
+{
+    char buf[64];
+    int fd, n;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+static int
+write_file(const char *path, const char *val)
+{
+    int fd, n;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+	return -1;
+    n = write(fd, val, strlen(val));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+static void *
+reader(void *arg)
+{
+    struct samples *s = arg;
+    char path[256];
+    unsigned long long t0;
+    unsigned int i = 0;
+
+    if (single_prop)
+	snprintf(path, sizeof(path), "%s/%s", batt_dir, single_prop);
+    while (!stop) {
+	/* every eighth read is the AC supply */
+	if (single_prop)
+	    ;
+	else if (i % (NUM_BATTERY_PROPS + 1) == NUM_BATTERY_PROPS)
+	    snprintf(path, sizeof(path), "%s/online", ac_dir);
+	else
+	    snprintf(path, sizeof(path), "%s/%s", batt_dir,
+		     battery_props[i % (NUM_BATTERY_PROPS + 1)]);
+	i++;
+	t0 = now_ns();
+	if (read_file(path) < 0)
+	    s->errors++;
+	else
+	    add_sample(s, now_ns() - t0);
+    }
+    return NULL;
+}
+
+static void *
+writer(void *arg)
+{
+    struct samples *s = arg;
+    char path[256], val[16];
+    unsigned long long t0;
+    unsigned int level = 0;
+
+    snprintf(path, sizeof(path), "%s/brightness", bl_dir);
+    while (!stop) {
+	/* sweep like a desktop brightness animation */
+	level = (level + 7) % 256;
+	snprintf(val, sizeof(val), "%u", level ? level : 1);
+	t0 = now_ns();
+	if (write_file(path, val) < 0)
+	    s->errors++;
+	else
+	    add_sample(s, now_ns() - t0);
+	if (write_interval_us)
+	    usleep(write_interval_us);
+    }
+    return NULL;
+}
+
+static int
+cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, struct samples *per_thread, int n, double secs)
+{
+    struct samples all = { 0 };
+    size_t i, j;
+
+    for (i = 0; i < (size_t)n; i++) {
+	for (j = 0; j < per_thread[i].count; j++)
+	    add_sample(&all, per_thread[i].ns[j]);
+	all.errors += per_thread[i].errors;
+    }
+    if (!all.count) {
+	printf("%-6s threads %2d  no samples (%lu errors)\n",
+	       name, n, all.errors);
+	return;
+    }
+    qsort(all.ns, all.count, sizeof(*all.ns), cmp_ull);
+    printf("%-6s threads %2d  ops %8zu  %10.1f ops/s  "
+	   "p50 %8.1f us  p99 %8.1f us  max %8.1f us  errors %lu\n",
+	   name, n, all.count, all.count / secs,
+	   all.ns[all.count / 2] / 1000.0,
+	   all.ns[all.count * 99 / 100] / 1000.0,
+	   all.ns[all.count - 1] / 1000.0, all.errors);
+    free(all.ns);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	    "usage: %s [-r readers] [-w writers] [-t seconds] "
+	    "[-i write_interval_us] [-p property]\n"
+	    "          [-B battery_dir] [-A ac_dir] [-L backlight_dir]\n",
+	    prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    int nreaders = 4, nwriters = 1, seconds = 10;
+    struct samples *rs, *ws;
+    pthread_t *threads;
+    unsigned long long t0;
+    double secs;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "r:w:t:i:p:B:A:L:h")) != -1) {
+	switch (c) {
+	case 'r': nreaders = atoi(optarg); break;
+	case 'w': nwriters = atoi(optarg); break;
+	case 't': seconds = atoi(optarg); break;
+	case 'i': write_interval_us = atoi(optarg); break;
+	case 'p': single_prop = optarg; break;
+	case 'B': batt_dir = optarg; break;
+	case 'A': ac_dir = optarg; break;
+	case 'L': bl_dir = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (nreaders < 0 || nwriters < 0 || seconds <= 0)
+	usage(argv[0]);
+
+    rs = calloc(nreaders + 1, sizeof(*rs));
+    ws = calloc(nwriters + 1, sizeof(*ws));
+    threads = calloc(nreaders + nwriters + 1, sizeof(*threads));
+    if (!rs || !ws || !threads) {
+	perror("calloc");
+	return 1;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < nreaders; i++)
+	if (pthread_create(&threads[i], NULL, reader, &rs[i])) {
+	    perror("pthread_create");
+	    return 1;
+	}
+    for (i = 0; i < nwriters; i++)
+	if (pthread_create(&threads[nreaders + i], NULL, writer, &ws[i])) {
+	    perror("pthread_create");
+	    return 1;
+	}
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nreaders + nwriters; i++)
+	pthread_join(threads[i], NULL);
+    secs = (now_ns() - t0) / 1e9;
+
+    report("read", rs, nreaders, secs);
+    report("write", ws, nwriters, secs);
+    return 0;
+}
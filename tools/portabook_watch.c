@@ -0,0 +1,120 @@
+/*
+ * portabook_watch.c - print battery snapshots from /dev/portabook
+ * Copyright (C) 2016  MURAMATSU Atsushi <amura@tomato.sakura.ne.jp>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+/*
+ * Prints one line per changed snapshot using blocking read(), or with
+ * -m samples the mapped page every -i milliseconds without syscalls
+ * in the read path.  With the module loaded as emulate=1 and
+ * battery_poll_interval set, changing emu_* parameters produces new
+ * snapshots.
+ *
+ *   make watch
+ *   tools/portabook_watch [-m] [-i interval_ms] [-n count]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../portabook_uapi.h"
+
+static void
+print_snapshot(const struct portabook_snapshot *s)
+{
+    printf("seq %llu t %llu.%03llu ac %d status %d cap %d%% "
+	   "%d mV %d mA (avg %d mA) %d mW tte %d s ttf %d s%s\n",
+	   (unsigned long long)s->seq,
+	   (unsigned long long)(s->timestamp_ns / 1000000000ULL),
+	   (unsigned long long)(s->timestamp_ns / 1000000ULL % 1000),
+	   s->ac_online, s->status, s->capacity,
+	   s->voltage_now / 1000, s->current_now / 1000,
+	   s->current_avg / 1000, s->power_now / 1000,
+	   s->time_to_empty_avg, s->time_to_full_avg,
+	   (s->flags & PORTABOOK_SNAPSHOT_STALE) ? " stale" : "");
+    fflush(stdout);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m] [-i interval_ms] [-n count] [-d device]\n",
+	    prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = "/dev/portabook";
+    struct portabook_snapshot snap;
+    const struct portabook_shared *sh;
+    unsigned long long last = 0;
+    int use_mmap = 0, interval_ms = 100, count = -1;
+    int c, fd;
+    ssize_t n;
+
+    while ((c = getopt(argc, argv, "mi:n:d:h")) != -1) {
+	switch (c) {
+	case 'm': use_mmap = 1; break;
+	case 'i': interval_ms = atoi(optarg); break;
+	case 'n': count = atoi(optarg); break;
+	case 'd': path = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	perror(path);
+	return 1;
+    }
+
+    if (!use_mmap) {
+	while (count-- != 0) {
+	    n = read(fd, &snap, sizeof(snap));
+	    if (n < 0) {
+		perror("read");
+		return 1;
+	    }
+	    if (n != sizeof(snap) || snap.version != PORTABOOK_SNAPSHOT_VERSION) {
+		fprintf(stderr, "unexpected record\n");
+		return 1;
+	    }
+	    print_snapshot(&snap);
+	}
+	return 0;
+    }
+
+    sh = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (sh == MAP_FAILED) {
+	perror("mmap");
+	return 1;
+    }
+    while (count != 0) {
+	portabook_shared_read(sh, &snap);
+	if (snap.seq != last) {
+	    print_snapshot(&snap);
+	    last = snap.seq;
+	    count--;
+	}
+	usleep(interval_ms * 1000);
+    }
+    return 0;
+}